@@ -0,0 +1,21 @@
+#include "../../include/dtv/encoder.h"
+
+#include <iostream>
+
+// Started by an Encoder with VideoSettings::remote, which passes the name of
+// the shared-memory queue it created
+int main(int argc, char *argv[]) {
+    if (argc != 2) {
+        std::cerr << "usage: direct-to-video-encoderd <queue name>\n";
+        return 2;
+    }
+
+    atg_dtv::Encoder encoder;
+    const atg_dtv::Encoder::Error err = encoder.serve(argv[1]);
+    if (err != atg_dtv::Encoder::Error::None) {
+        std::cerr << "direct-to-video-encoderd: error " << int(err) << "\n";
+        return 1;
+    }
+
+    return 0;
+}
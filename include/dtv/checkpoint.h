@@ -0,0 +1,56 @@
+#ifndef ATG_DIRECT_TO_VIDEO_CHECKPOINT_H
+#define ATG_DIRECT_TO_VIDEO_CHECKPOINT_H
+
+#include <cinttypes>
+#include <string>
+#include <vector>
+
+namespace atg_dtv {
+class Checkpoint {
+public:
+    struct Segment {
+        int64_t frames;
+        int64_t audioSamples;
+    };
+
+public:
+    Checkpoint();
+    ~Checkpoint();
+
+    void initialize(const std::string &fname, const std::string &manifestFname,
+                    int frameRate);
+    bool load(const std::string &manifestFname);
+    bool save();
+
+    void addSegment(int64_t frames, int64_t audioSamples);
+    std::string getSegmentFname(int index) const;
+
+    // Joins all durable segments into the final output by stream copy, then
+    // deletes the segments and the manifest. A keyframe index of the joined
+    // file is written when indexFname is not empty. With no segments at all
+    // there is nothing to join and no output is written.
+    bool concatenate(const char *formatName = nullptr,
+                     const std::string &indexFname = "");
+    void removeFiles();
+
+    inline const std::string &getFname() const { return m_fname; }
+    inline const std::string &getManifestFname() const {
+        return m_manifestFname;
+    }
+    inline int getFrameRate() const { return m_frameRate; }
+    inline int getSegmentCount() const { return (int) m_segments.size(); }
+    inline int64_t getFrames() const { return m_frames; }
+    inline int64_t getAudioSamples() const { return m_audioSamples; }
+
+private:
+    std::string m_fname;
+    std::string m_manifestFname;
+    int m_frameRate;
+
+    std::vector<Segment> m_segments;
+    int64_t m_frames;
+    int64_t m_audioSamples;
+};
+} /* namespace atg_dtv */
+
+#endif /* ATG_DIRECT_TO_VIDEO_CHECKPOINT_H */
@@ -0,0 +1,47 @@
+#ifndef ATG_DIRECT_TO_VIDEO_CONVERSION_CACHE_H
+#define ATG_DIRECT_TO_VIDEO_CONVERSION_CACHE_H
+
+#include <cinttypes>
+#include <vector>
+
+struct SwsContext;
+
+namespace atg_dtv {
+class ConversionCache {
+public:
+    ConversionCache();
+    ~ConversionCache();
+
+    // Entries own their contexts
+    ConversionCache(const ConversionCache &) = delete;
+    ConversionCache &operator=(const ConversionCache &) = delete;
+
+    void initialize(int capacity);
+    void destroy();
+
+    // Returns a conversion context for the given source and destination,
+    // evicting the least recently used entry if the cache is full. Formats are
+    // AVPixelFormat values.
+    SwsContext *getContext(int srcWidth, int srcHeight, int srcFormat,
+                           int dstWidth, int dstHeight, int dstFormat,
+                           int flags);
+
+    inline int getSize() const { return (int) m_entries.size(); }
+
+private:
+    struct Entry {
+        int srcWidth, srcHeight, srcFormat;
+        int dstWidth, dstHeight, dstFormat;
+        int flags;
+
+        SwsContext *context;
+        uint64_t lastUsed;
+    };
+
+    std::vector<Entry> m_entries;
+    int m_capacity;
+    uint64_t m_clock;
+};
+} /* namespace atg_dtv */
+
+#endif /* ATG_DIRECT_TO_VIDEO_CONVERSION_CACHE_H */
@@ -2,5 +2,8 @@
 #define ATG_DIRECT_TO_VIDEO_DTV_H
 
 #include "encoder.h"
+#include "encoder_pool.h"
+#include "image_sequence_writer.h"
+#include "trace.h"
 
 #endif /* ATG_DIRECT_TO_VIDEO_DTV_H */
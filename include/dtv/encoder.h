@@ -1,23 +1,38 @@
 #ifndef ATG_DIRECT_TO_VIDEO_ENCODER_H
 #define ATG_DIRECT_TO_VIDEO_ENCODER_H
 
+#include "checkpoint.h"
+#include "conversion_cache.h"
 #include "frame_queue.h"
+#include "keyframe_index.h"
+#include "latency_stats.h"
+#include "shared_ring.h"
+#include "speed_governor.h"
+#include "thread_pool.h"
 
+#include <atomic>
+#include <condition_variable>
+#include <functional>
+#include <future>
 #include <mutex>
 #include <string>
 #include <thread>
+#include <vector>
 
 struct AVStream;
 struct AVCodecContext;
 struct AVFrame;
 struct AVPacket;
-struct SwsContext;
 struct SwrContext;
 struct AVFormatContext;
 struct AVOutputFormat;
 struct AVCodec;
+struct AVAudioFifo;
 
 namespace atg_dtv {
+class EncoderPool;
+class Transcoder;
+
 struct OutputStream {
     AVStream *av_stream = nullptr;
     AVCodecContext *codecContext = nullptr;
@@ -29,12 +44,15 @@ struct OutputStream {
     AVFrame *frame = nullptr, *tempFrame = nullptr;
     AVPacket *tempPacket = nullptr;
 
-    SwsContext *swsContext = nullptr;
+    ConversionCache conversionCache;
+    int scalerFlags = 0;
     SwrContext *swrContext = nullptr;
 };
 
 class Encoder {
 public:
+    enum class IntermediateCodec { FFV1, UtVideo, Raw };
+
     struct VideoSettings {
         std::string fname = "";
         int width = 1920;
@@ -43,10 +61,115 @@ public:
         int inputHeight = 1080;
         int frameRate = 60;
         int bitRate = 30000000;
+
+        // VBV constraints in bits per second and bits; 0 leaves them to the
+        // codec
+        int maxBitRate = 0;
+        int vbvBufferSize = 0;
+
         bool audio = false;
         bool hardwareEncoding = true;
         bool inputAlpha = false;
         bool bgr = false;
+
+        // Threads the video codec may use; 0 leaves it to the codec
+        int codecThreads = 0;
+
+        // Maximum distance between keyframes; 0 uses ten seconds of video.
+        // Frame::m_keyframe forces one earlier.
+        int keyframeInterval = 0;
+
+        // Write the pts and byte offset of every video keyframe to a side-car
+        // file (keyframeIndexFname, or fname + ".keyframes"). Offsets point
+        // at or before the keyframe's data.
+        bool keyframeIndex = false;
+        std::string keyframeIndexFname = "";
+
+        // Step encoder presets and scaler quality based on queue pressure
+        bool adaptiveSpeed = false;
+        SpeedGovernor::Settings speedGovernor;
+
+        // Capture losslessly to a fast intermediate file and transcode it to
+        // the final codec in the background after commit()
+        bool intermediate = false;
+        IntermediateCodec intermediateCodec = IntermediateCodec::FFV1;
+        std::string intermediateFname = "";
+        bool keepIntermediate = false;
+        ThreadPool *transcodePool = nullptr;
+
+        // Run the encoder thread at reduced OS priority
+        bool lowPriority = false;
+
+        // Minimize the time from submitFrame() to the written packet: a
+        // single-frame queue, sliced conversion on the encoder thread (unless
+        // convertOnSubmit), sliced encoding without B-frames or lookahead,
+        // intra refresh every keyframeInterval frames (default one second)
+        // instead of periodic IDR frames, and a flush after every packet
+        bool lowLatency = false;
+
+        // Frames reference caller-owned pixels through
+        // Frame::setExternalBuffer() and get no pixel storage of their own. A
+        // frame submitted without one fails with MissingFrameBuffer.
+        bool externalBuffers = false;
+
+        // Number of conversion contexts kept for frames whose size differs
+        // from inputWidth x inputHeight
+        int conversionCacheSize = 4;
+
+        // Convert frames to the encoder's pixel format and output size in
+        // submitFrame() so that queue slots hold e.g. YUV420P instead of RGB.
+        // The conversion is split across conversionThreads when the frame
+        // height is not scaled.
+        bool convertOnSubmit = false;
+        int conversionThreads = 1;
+
+        // Size the queue to hold this many bytes of pixel data instead of
+        // bufferSize frames
+        size_t bufferBytes = 0;
+
+        // Frames submitted while the queue is full go to a spill file
+        // (spillFname, or fname + ".spill") instead of blocking newFrame() or
+        // being dropped, until spillLimit bytes are waiting (0 for no limit).
+        // They are encoded in order once the queue drains.
+        bool spill = false;
+        std::string spillFname = "";
+        bool spillCompression = true;
+        size_t spillLimit = 0;
+
+        // Write the output as self-contained segments of checkpointInterval
+        // frames and record each finished one in a manifest, so that an
+        // interrupted render can be picked up again with resume(). With
+        // adaptiveSpeed and a container that carries codec parameters in its
+        // header (e.g. MP4), all segments keep the first one's encoder preset
+        // so that they can be joined; only the scaler adapts. Each segment's
+        // audio starts with the codec's priming samples (1024 for AAC), which
+        // stay in the joined output as a short gap at every segment boundary.
+        bool checkpoint = false;
+        int checkpointInterval = 3600;
+        std::string checkpointFname = "";
+
+        // Leave FFmpeg to a separate direct-to-video-encoderd process
+        // (encoderdPath) that reads frames in place from a shared-memory
+        // queue, so that a crash in a codec or driver does not take the
+        // caller down. With checkpoint, a crashed encoder is restarted up to
+        // maxEncoderRestarts times and resumes from the last durable segment;
+        // queue slots are then only reused once their frames are durable, and
+        // checkpointInterval is capped at half the queue. Linux only, and not
+        // available with prepare(), reconfigure(), an EncoderPool,
+        // externalBuffers, convertOnSubmit or spill. The speed and transcode
+        // callbacks are not called. With intermediate, stop() returns once
+        // the capture is finished and the transcode carries on in the encoder
+        // process: waitTranscode() and transcoding() don't see it, and
+        // getError() doesn't report its errors.
+        bool remote = false;
+        std::string encoderdPath = "direct-to-video-encoderd";
+        int maxEncoderRestarts = 3;
+    };
+
+    struct RateControl {
+        int bitRate = 30000000;
+        int maxBitRate = 0;
+        int vbvBufferSize = 0;
     };
 
     enum class Error {
@@ -69,37 +192,202 @@ public:
         CouldNotEncodeFrame,
         CouldNotWriteOutputPacket,
         CouldNotCreateResamplerContext,
+        CouldNotOpenInputFile,
+        CouldNotFindDecoder,
+        CouldNotOpenDecoder,
+        CouldNotDecodeFrame,
+        CouldNotWriteCheckpoint,
+        CouldNotConcatenateSegments,
+        CheckpointMismatch,
+        CouldNotWriteKeyframeIndex,
+        MemoryBudgetExceeded,
+        AlreadyRunning,
+        NotPrepared,
+        NotRunning,
+        InvalidRateControl,
+        ReconfigureNotSupported,
+        CouldNotOpenSpillFile,
+        CouldNotSpillFrame,
+        RemoteNotSupported,
+        CouldNotMapSharedMemory,
+        CouldNotStartEncoderDaemon,
+        EncoderDaemonCrashed,
+        MissingFrameBuffer,
+        PoolNotSupported,
+        PoolDestroyed,
+    };
+
+    struct TranscodeProgress {
+        int64_t frames = 0;
+        int64_t totalFrames = 0;
+        bool complete = false;
+        Error error = Error::None;
     };
 
+    typedef std::function<void(const TranscodeProgress &)> TranscodeCallback;
+
 public:
     Encoder();
     ~Encoder();
 
-    void run(VideoSettings &settings, int bufferSize);
+    // Returns without waiting for the output to open; that happens on the
+    // encoder thread and the future reports its result. Frames submitted in
+    // the meantime are buffered in the queue.
+    std::shared_future<Error> run(VideoSettings &settings, int bufferSize);
+
+    // Opens the output and codecs ahead of time so that start() begins
+    // encoding immediately. A prepared session that is never started is
+    // discarded by run(), stop() or the destructor. Not available while the
+    // encoder belongs to an EncoderPool.
+    Error prepare(VideoSettings &settings, int bufferSize);
+    std::shared_future<Error> start();
+
     void commit();
     void stop();
     Frame *newFrame(bool wait = false);
+
+    // Requests a frame with its own input size; it is scaled to the output
+    // size by the encoder
+    Frame *newFrame(int width, int height, bool wait = false);
     void submitFrame();
     Error getError();
 
+    // Changes the video bitrate without restarting the output. NVENC, and x264
+    // opened with maxBitRate and vbvBufferSize set, take it from the next
+    // frame; x264 then only accepts changes that keep VBV on and returns
+    // InvalidRateControl otherwise. Other codecs are reopened at the next
+    // keyframe, which needs a container without global headers. Anything else
+    // returns ReconfigureNotSupported. Waits for startup if run() has not
+    // finished opening the output.
+    Error reconfigure(const RateControl &rateControl);
+    Error setBitrate(int bitRate);
+
+    // Submit-to-write latency of recent frames. A remote session's is
+    // refreshed from the encoder process a few times a second.
+    LatencyStats::Summary getLatency();
+
+    // Loads a checkpoint manifest before run(); the producer then skips the
+    // first getResumeFrame() frames, which are already on disk
+    bool resume(const std::string &checkpointFname);
+    inline int64_t getResumeFrame() const { return m_resumeFrame; }
+
+    // Called from the encoder thread whenever the speed level changes
+    void setSpeedCallback(const SpeedGovernor::Callback &callback);
+
+    // Called from the transcode thread as intermediate files are converted.
+    // A new session doesn't wait for earlier transcodes unless it writes to
+    // one of their files; these two cover all that are still in flight.
+    void setTranscodeCallback(const TranscodeCallback &callback);
+    void waitTranscode();
+    bool transcoding();
+
+    // Encodes a remote session from the named shared-memory queue until the
+    // producer commits or exits; used by direct-to-video-encoderd
+    Error serve(const std::string &ringName);
+
     inline bool running() const { return !m_stopped; }
+    inline int getAudioChannels() const { return m_audioChannels; }
 
 private:
-    void setup();
+    friend class EncoderPool;
+
+    Error initializeSession(VideoSettings &settings, int bufferSize);
+    Error startup();
+    Error setup(const std::string &fname);
+    void release();
     void worker();
+    Error encodeFrame(Frame *frame);
+    Error encodeAudio(bool drain);
+    Error applyRateControl(const Frame *frame);
+    void complete(Error err);
+
+    // Encodes up to maxFrames queued frames without blocking; returns true
+    // once the session has finished
+    bool step(int maxFrames, int *frames);
     void destroy();
+    void destroyStaging();
+    Error convertFrame(Frame *src, Frame *dst);
+    Error convertSlices(Frame *src, uint8_t *const data[4],
+                        const int linesize[4]);
+    Error convertVideoFrame(Frame *src);
+    std::string getOutputFname() const;
+    std::string getKeyframeIndexFname() const;
+    Error finishOutput(bool drainAudio);
+    Error closeSegment(int64_t frames, bool final);
+    Error finishCheckpoint(int64_t frames);
+    Error adjustSpeed();
+    void startTranscode(int64_t totalFrames);
+
+    // Moves the last session's transcode to the in-flight list, frees the
+    // finished ones and waits for those using the new session's files
+    void retireTranscodes(const VideoSettings &settings);
+    Error createSharedQueue(const VideoSettings &settings, int capacity);
+    void supervise();
 
 private:
     std::thread *m_worker;
     std::mutex m_lock;
     Error m_error;
 
+    // LiveVbv is live reconfiguration that only works while VBV stays on
+    enum class RateControlMode { Unsupported, Live, LiveVbv, Reopen };
+
+    EncoderPool *m_scheduler = nullptr;
+    std::condition_variable m_completeCv;
+    bool m_complete = true;
+
+    std::promise<Error> m_promise;
+    std::shared_future<Error> m_ready;
+    bool m_started = false;
+    bool m_prepared = false;
+
     AVFormatContext *m_oc = nullptr;
     const AVOutputFormat *m_fmt = nullptr;
     const AVCodec *m_videoCodec = nullptr, *m_audioCodec = nullptr;
     OutputStream m_videoStream, m_audioStream;
     bool m_openedFile = false;
     int m_lineWidth = 0;
+    int m_audioChannels = 0;
+    int m_audioSampleRate = 0;
+    AVAudioFifo *m_audioFifo = nullptr;
+    int64_t m_framesWritten = 0;
+    int64_t m_segmentFrames = 0;
+    KeyframeIndex m_keyframeIndex;
+    LatencyStats m_latency;
+
+    Frame m_staging;
+    Frame *m_pendingFrame = nullptr;
+    ConversionCache *m_sliceCaches = nullptr;
+    int m_sliceCount = 0;
+    ThreadPool m_conversionPool;
+    std::atomic<int> m_conversionFlags;
+    int m_convertedFormat = 0;
+    size_t m_convertedSize = 0;
+
+    SpeedGovernor m_governor;
+    SpeedGovernor::Callback m_speedCallback;
+
+    // Speed level whose encoder preset every checkpoint segment is opened
+    // with when the container carries global headers; -1 until the first
+    int m_segmentPresetLevel = -1;
+
+    Transcoder *m_transcoder = nullptr;
+    std::vector<Transcoder *> m_transcoders;
+    TranscodeCallback m_transcodeCallback;
+    VideoSettings m_finalSettings;
+    int m_bufferSize = 0;
+
+    RateControlMode m_rateControlMode = RateControlMode::Unsupported;
+    RateControl m_rateControl;
+    std::atomic<bool> m_rateControlPending;
+
+    Checkpoint m_checkpoint;
+    bool m_resume = false;
+    int64_t m_resumeFrame = 0;
+
+    SharedRing m_ring;
+    bool m_serving = false;
+    LatencyStats::Summary m_remoteLatency;
 
 private:
     FrameQueue m_queue;
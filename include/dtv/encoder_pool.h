@@ -0,0 +1,87 @@
+#ifndef ATG_DIRECT_TO_VIDEO_ENCODER_POOL_H
+#define ATG_DIRECT_TO_VIDEO_ENCODER_POOL_H
+
+#include "encoder.h"
+#include "thread_pool.h"
+
+#include <mutex>
+#include <vector>
+
+namespace atg_dtv {
+// Runs many encoder sessions on one bounded set of threads instead of a
+// thread per encoder. Sessions with queued frames are stepped a few frames
+// at a time, lowest weighted progress first, so that busy sessions can't
+// starve the rest.
+class EncoderPool {
+public:
+    enum class Priority { Low, Normal, High };
+
+    struct Settings {
+        // Number of threads; 0 uses the hardware concurrency
+        int threads = 0;
+
+        // Threads each codec may create on top of the pool; 0 leaves it to
+        // the codec
+        int codecThreads = 1;
+
+        // Bytes of frame queue memory shared by all sessions; 0 is unlimited
+        size_t memoryBudget = 0;
+
+        // Frames encoded per scheduling step
+        int framesPerStep = 4;
+    };
+
+public:
+    EncoderPool();
+    ~EncoderPool();
+
+    void initialize(const Settings &settings);
+
+    // Sessions that are still running fail with PoolDestroyed; their encoders
+    // must not be fed concurrently with this, but can be stopped afterwards
+    void destroy();
+
+    // Starts the encoder on the pool instead of its own thread. Its queue is
+    // trimmed to fit the remaining memory budget; the other calls to the
+    // encoder are unchanged. Returns AlreadyRunning if the encoder already
+    // has a session in this pool.
+    Encoder::Error run(Encoder *encoder, Encoder::VideoSettings &settings,
+                       int bufferSize, Priority priority = Priority::Normal);
+    void setPriority(Encoder *encoder, Priority priority);
+
+    size_t getMemoryUsed();
+    int getSessionCount();
+
+private:
+    friend class Encoder;
+
+    struct Session {
+        Encoder *encoder;
+        Priority priority;
+        size_t memory;
+
+        // Frames encoded divided by the priority weight
+        double progress;
+
+        bool pending;
+        bool running;
+    };
+
+    void notify(Encoder *encoder);
+    void schedule();
+    Session *findSession(Encoder *encoder);
+
+    static double getWeight(Priority priority);
+
+private:
+    std::mutex m_lock;
+    std::vector<Session *> m_sessions;
+    size_t m_memoryUsed;
+    double m_progress;
+
+    ThreadPool m_threads;
+    Settings m_settings;
+};
+} /* namespace atg_dtv */
+
+#endif /* ATG_DIRECT_TO_VIDEO_ENCODER_POOL_H */
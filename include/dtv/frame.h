@@ -1,22 +1,62 @@
 #ifndef ATG_DIRECT_TO_VIDEO_FRAME_H
 #define ATG_DIRECT_TO_VIDEO_FRAME_H
 
+#include <chrono>
 #include <cinttypes>
+#include <cstddef>
+#include <functional>
 
 namespace atg_dtv {
 class Frame {
+public:
+    typedef std::function<void()> ReleaseCallback;
+
+    // Alignment of m_converted and of the rows the encoder lays out in it
+    static const int ConvertedAlignment = 64;
+
 public:
     Frame();
     ~Frame();
 
+    // Reads pixels straight from caller-owned memory instead of m_rgb. The
+    // stride may be negative, and the release callback is invoked from the
+    // encoder thread once the pixels are no longer needed.
+    void setExternalBuffer(const uint8_t *data, int stride, bool flip = false,
+                           const ReleaseCallback &release = nullptr);
+    void releaseExternalBuffer();
+
+    // Returns the first displayed row and the distance to the next one
+    const uint8_t *getPixels(int *stride) const;
+
+    // Grows the frame's buffers as needed to hold the given pixels, converted
+    // data and audio, and resets its per-frame state
+    void allocate(int width, int height, int lineWidth, int audioSamples,
+                  int audioChannels, size_t convertedSize);
+    void destroy();
+
     uint8_t *m_rgb;
     int m_width, m_height;
     int m_maxWidth, m_maxHeight;
     int m_lineWidth;
+    bool m_flip;
+
+    // Starts a new GOP at this frame, e.g. on a scene cut
+    bool m_keyframe;
+
+    const uint8_t *m_external;
+    int m_externalStride;
+    ReleaseCallback m_release;
+
+    // Pixels already converted to the encoder's format and output size
+    uint8_t *m_converted;
+    size_t m_convertedCapacity;
 
     int16_t *m_audio;
     int m_audioCapacity;
     int m_audioSamples;
+
+    // Set by Encoder::submitFrame()
+    std::chrono::steady_clock::time_point m_submitTime;
 };
 } /* namespace atg_dtv */
 
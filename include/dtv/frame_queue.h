@@ -2,9 +2,12 @@
 #define ATG_DIRECT_TO_VIDEO_FRAME_QUEUE_H
 
 #include "frame.h"
+#include "shared_ring.h"
+#include "spill_file.h"
 
 #include <condition_variable>
 #include <mutex>
+#include <string>
 
 namespace atg_dtv {
 class FrameQueue {
@@ -13,16 +16,60 @@ public:
     ~FrameQueue();
 
     void initialize(int size);
+
+    // Uses the ring's slots in place of frames of its own, so that the
+    // producer and the consumer can be different processes. Only
+    // newFrame()/submitFrame() are used on the producer side, and
+    // waitFrame()/peekFrame()/popFrame() on the consumer side. Frames the
+    // consumer read but never released are read again.
+    void initializeShared(SharedRing *ring, bool producer);
     void destroy();
 
+    // Frames requested while the ring is full are then written to a spill file
+    // instead of waiting or failing, as long as no more than spillLimit bytes
+    // are unread (0 for no limit). They are read back into the ring in order
+    // as it drains.
+    bool enableSpill(const std::string &fname, bool compress, int pixelSize,
+                     size_t spillLimit);
+
     Frame *newFrame(int width, int height, int lineWidth, int audioSamples,
-                    int audioChannels, bool wait = false);
-    void submitFrame();
+                    int audioChannels, bool wait = false,
+                    size_t convertedSize = 0);
+    // Returns false if a spilled frame could not be written; it is dropped
+    bool submitFrame();
     Frame *waitFrame();
+
+    // Returns the oldest submitted frame without blocking
+    Frame *peekFrame();
     void popFrame();
 
+    // With a shared ring, keeps popped frames from being overwritten until
+    // releaseFrames() is given a count beyond them
+    void holdFrames(bool hold);
+    void releaseFrames(int64_t frames);
+
+    // Hands out submitted frames one at a time so that several can be
+    // processed concurrently; slots are recycled in submission order once
+    // released
+    Frame *acquireFrame();
+    void releaseFrame(Frame *frame);
+
     void stop();
 
+    // Includes spilled frames
+    int getLength();
+    inline int getCapacity() const { return m_capacity; }
+    bool hasSpillError();
+
+private:
+    void loadSpilled(std::unique_lock<std::mutex> &lk);
+
+    Frame *newSharedFrame(int width, int height, int audioSamples,
+                          int audioChannels, bool wait);
+    void submitSharedFrame();
+    Frame *loadSharedFrame(uint32_t index);
+    bool isStopped();
+
 private:
     std::mutex m_lock;
     std::condition_variable m_cv;
@@ -32,7 +79,24 @@ private:
     int m_length;
     int m_readIndex;
 
+    bool *m_released;
+    int m_acquired;
+
     bool m_stopped;
+
+    SpillFile m_spill;
+    Frame m_spillFrame;
+    bool m_spillPending;
+    int m_spilled;
+    size_t m_spillBytes;
+    size_t m_spillLimit;
+    int m_audioChannels;
+    bool m_spillError;
+    bool m_spillResync;
+
+    SharedRing *m_ring;
+    bool m_producer;
+    bool m_holdFrames;
 };
 } /* namespace atg_dtv */
 
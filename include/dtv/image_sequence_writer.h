@@ -0,0 +1,90 @@
+#ifndef ATG_DIRECT_TO_VIDEO_IMAGE_SEQUENCE_WRITER_H
+#define ATG_DIRECT_TO_VIDEO_IMAGE_SEQUENCE_WRITER_H
+
+#include "encoder.h"
+#include "frame_queue.h"
+#include "thread_pool.h"
+
+#include <mutex>
+#include <string>
+#include <vector>
+
+struct AVCodecContext;
+struct AVFrame;
+struct AVPacket;
+struct SwsContext;
+
+namespace atg_dtv {
+struct ImageEncoderContext {
+    AVCodecContext *codecContext = nullptr;
+    AVFrame *frame = nullptr;
+    AVPacket *packet = nullptr;
+    SwsContext *swsContext = nullptr;
+};
+
+class ImageSequenceWriter {
+public:
+    enum class ImageFormat { Png, Tiff, Exr };
+
+    struct Settings {
+        // printf-style pattern that receives the frame index as an int;
+        // indices past INT_MAX fail with CouldNotOpenFile
+        std::string fname = "frame_%06d.png";
+        ImageFormat format = ImageFormat::Png;
+        int firstIndex = 0;
+        int width = 1920;
+        int height = 1080;
+        int inputWidth = 1920;
+        int inputHeight = 1080;
+        bool inputAlpha = false;
+        bool bgr = false;
+
+        // Number of encoding threads; 0 uses the hardware concurrency
+        int threads = 0;
+
+        // Frames reference caller-owned pixels through
+        // Frame::setExternalBuffer() and get no pixel storage of their own. A
+        // frame submitted without one fails with MissingFrameBuffer.
+        bool externalBuffers = false;
+    };
+
+    typedef Encoder::Error Error;
+
+public:
+    ImageSequenceWriter();
+    ~ImageSequenceWriter();
+
+    void run(Settings &settings, int bufferSize);
+    void commit();
+    void stop();
+    Frame *newFrame(bool wait = false);
+    void submitFrame();
+    Error getError();
+
+    inline bool running() const { return !m_stopped; }
+
+private:
+    void writeImage(Frame *frame, int64_t index);
+    Error encodeImage(ImageEncoderContext *context, Frame *frame,
+                      int64_t index);
+    ImageEncoderContext *acquireContext(Error *err);
+    void releaseContext(ImageEncoderContext *context);
+    void destroy();
+
+private:
+    std::mutex m_lock;
+    Error m_error;
+
+    ThreadPool m_pool;
+    std::vector<ImageEncoderContext *> m_contexts;
+    int64_t m_nextIndex;
+    int m_lineWidth;
+
+private:
+    FrameQueue m_queue;
+    Settings m_settings;
+    bool m_stopped;
+};
+} /* namespace atg_dtv */
+
+#endif /* ATG_DIRECT_TO_VIDEO_IMAGE_SEQUENCE_WRITER_H */
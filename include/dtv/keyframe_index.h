@@ -0,0 +1,29 @@
+#ifndef ATG_DIRECT_TO_VIDEO_KEYFRAME_INDEX_H
+#define ATG_DIRECT_TO_VIDEO_KEYFRAME_INDEX_H
+
+#include <cinttypes>
+#include <cstdio>
+#include <string>
+
+namespace atg_dtv {
+// Side-car text file listing "pts offset" for every video keyframe, with pts
+// in the stream time base given on the header line
+class KeyframeIndex {
+public:
+    KeyframeIndex();
+    ~KeyframeIndex();
+
+    bool open(const std::string &fname, int timeBaseNum, int timeBaseDen);
+    void record(int64_t pts, int64_t offset);
+    bool close();
+
+    inline bool isOpen() const { return m_file != nullptr; }
+    inline int64_t getCount() const { return m_count; }
+
+private:
+    FILE *m_file;
+    int64_t m_count;
+};
+} /* namespace atg_dtv */
+
+#endif /* ATG_DIRECT_TO_VIDEO_KEYFRAME_INDEX_H */
@@ -0,0 +1,50 @@
+#ifndef ATG_DIRECT_TO_VIDEO_LATENCY_STATS_H
+#define ATG_DIRECT_TO_VIDEO_LATENCY_STATS_H
+
+#include <chrono>
+#include <cinttypes>
+#include <map>
+#include <mutex>
+#include <vector>
+
+namespace atg_dtv {
+// Time from submitFrame() until the packet holding the frame is written,
+// matched up by pts since codecs may hold frames back
+class LatencyStats {
+public:
+    typedef std::chrono::steady_clock Clock;
+
+    // Percentiles are in seconds over the most recent window of frames
+    struct Summary {
+        int64_t frames = 0;
+        double p50 = 0.0;
+        double p90 = 0.0;
+        double p99 = 0.0;
+        double max = 0.0;
+    };
+
+public:
+    LatencyStats();
+    ~LatencyStats();
+
+    void initialize(int window);
+
+    // Called from the encoder thread as a frame is sent to the codec and as
+    // each packet is written
+    void begin(int64_t pts, Clock::time_point submitted);
+    void end(int64_t pts);
+
+    Summary getSummary();
+
+private:
+    std::map<int64_t, Clock::time_point> m_inFlight;
+
+    std::mutex m_lock;
+    std::vector<double> m_samples;
+    int m_window;
+    int m_next;
+    int64_t m_frames;
+};
+} /* namespace atg_dtv */
+
+#endif /* ATG_DIRECT_TO_VIDEO_LATENCY_STATS_H */
@@ -0,0 +1,116 @@
+#ifndef ATG_DIRECT_TO_VIDEO_SHARED_RING_H
+#define ATG_DIRECT_TO_VIDEO_SHARED_RING_H
+
+#include "latency_stats.h"
+
+#include <cinttypes>
+#include <cstddef>
+#include <string>
+
+struct SharedRingHeader;
+
+namespace atg_dtv {
+// Fixed-size frame slots in a named POSIX shared-memory segment, written by a
+// producer process and read by an encoder process. The counters are futex
+// words so that either side can sleep on them. Only available on Linux.
+class SharedRing {
+public:
+    enum class Counter {
+        Written,
+        Read,
+        Released,
+        Committed,
+        Status,
+        Count
+    };
+
+    enum class Status : uint32_t { Starting, Running, Complete };
+
+    struct Layout {
+        int capacity = 0;
+        int maxWidth = 0;
+        int maxHeight = 0;
+        int lineWidth = 0;
+
+        // Samples times channels
+        int audioCapacity = 0;
+    };
+
+    // Frame state that is otherwise only kept in process-local members
+    struct Slot {
+        int32_t width;
+        int32_t height;
+        int32_t flip;
+        int32_t keyframe;
+        int32_t audioSamples;
+        int32_t reserved;
+        int64_t submitTime;
+    };
+
+public:
+    SharedRing();
+    ~SharedRing();
+
+    static bool isSupported();
+
+    // A name that no other ring of this process uses
+    static std::string uniqueName();
+
+    // The creator removes the segment again in close()
+    bool create(const std::string &name, const Layout &layout,
+                const std::string &config);
+    bool attach(const std::string &name);
+    void close();
+
+    // Removes the segment's name; existing mappings stay valid
+    void unlink();
+
+    Slot *getSlot(int index);
+    uint8_t *getPixels(int index);
+    int16_t *getAudio(int index);
+
+    uint32_t load(Counter counter) const;
+    void store(Counter counter, uint32_t value);
+    void wake(Counter counter);
+
+    // Returns true once the counter no longer holds value; false on timeout
+    bool wait(Counter counter, uint32_t value, int timeoutMs);
+
+    void setError(int error);
+    int getError() const;
+    int getRestarts() const;
+    void addRestart();
+    void setFrameOffset(int64_t frameOffset);
+    int64_t getFrameOffset() const;
+    bool isCreatorAlive() const;
+
+    // Published by the encoder process, whose packets the latency ends at
+    void setLatency(const LatencyStats::Summary &summary);
+    LatencyStats::Summary getLatency() const;
+
+    inline bool isOpen() const { return m_header != nullptr; }
+    inline const std::string &getName() const { return m_name; }
+    inline const Layout &getLayout() const { return m_layout; }
+    inline const std::string &getConfig() const { return m_config; }
+
+private:
+    // Returns the size of the segment
+    size_t computeOffsets();
+    bool map(size_t size, bool create);
+
+private:
+    std::string m_name;
+    Layout m_layout;
+    std::string m_config;
+    bool m_owner;
+
+    SharedRingHeader *m_header;
+    uint8_t *m_slots;
+    size_t m_size;
+    size_t m_slotSize;
+    size_t m_pixelsOffset;
+    size_t m_audioOffset;
+};
+} /* namespace atg_dtv */
+
+#endif /* ATG_DIRECT_TO_VIDEO_SHARED_RING_H */
@@ -0,0 +1,96 @@
+#ifndef ATG_DIRECT_TO_VIDEO_SPEED_GOVERNOR_H
+#define ATG_DIRECT_TO_VIDEO_SPEED_GOVERNOR_H
+
+#include <cinttypes>
+#include <functional>
+
+namespace atg_dtv {
+class SpeedGovernor {
+public:
+    struct Level {
+        const char *x264Preset;
+        const char *nvencPreset;
+        int scalerFlags;
+    };
+
+    struct Settings {
+        // Queue occupancy (0-1) above which the encoder is considered to be
+        // falling behind, and below which it is considered to have headroom
+        double highWatermark = 0.75;
+        double lowWatermark = 0.25;
+
+        // Encode time budget per frame in seconds; 0 uses 1 / frameRate
+        double targetFrameTime = 0.0;
+
+        // Fraction of the budget under which the encode time counts as relaxed
+        double relaxRatio = 0.6;
+
+        // Number of consecutive relaxed evaluations required before stepping
+        // back towards higher quality
+        int relaxEvaluations = 2;
+
+        // Frames between evaluations
+        int evaluationInterval = 12;
+
+        // -1 starts at the baseline level, which uses the same preset and
+        // scaler as a session without adaptiveSpeed
+        int initialLevel = -1;
+    };
+
+    struct Adjustment {
+        int64_t frameIndex;
+        int previousLevel;
+        int level;
+
+        double queueOccupancy;
+        double encodeTime;
+        double targetFrameTime;
+
+        const char *encoderPreset;
+        bool encoderPresetChanged;
+        int scalerFlags;
+        bool scalerChanged;
+    };
+
+    typedef std::function<void(const Adjustment &)> Callback;
+
+public:
+    SpeedGovernor();
+    ~SpeedGovernor();
+
+    void initialize(const Settings &settings, double targetFrameTime);
+    void recordFrame(int queueLength, int queueCapacity, double encodeTime);
+    int evaluate();
+
+    // Keeps the governor at or above the given level, e.g. when the encoder
+    // can't be reopened with a slower preset
+    void setMinLevel(int level);
+
+    inline int getLevel() const { return m_level; }
+    inline double getQueueOccupancy() const { return m_lastOccupancy; }
+    inline double getEncodeTime() const { return m_lastEncodeTime; }
+    inline double getTargetFrameTime() const { return m_targetFrameTime; }
+
+    static int getLevelCount();
+    static int getBaselineLevel();
+    static const Level &getLevelSettings(int level);
+
+private:
+    Settings m_settings;
+    double m_targetFrameTime;
+
+    int m_level;
+    int m_minLevel;
+    int m_relaxedCount;
+
+    int m_samples;
+    int m_occupancySamples;
+    double m_occupancyTotal;
+    double m_encodeTimeTotal;
+
+    double m_lastOccupancy;
+    double m_lastEncodeTime;
+};
+} /* namespace atg_dtv */
+
+#endif /* ATG_DIRECT_TO_VIDEO_SPEED_GOVERNOR_H */
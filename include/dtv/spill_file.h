@@ -0,0 +1,64 @@
+#ifndef ATG_DIRECT_TO_VIDEO_SPILL_FILE_H
+#define ATG_DIRECT_TO_VIDEO_SPILL_FILE_H
+
+#include "frame.h"
+
+#include <cstdio>
+#include <string>
+#include <vector>
+
+namespace atg_dtv {
+// Append-only file of frames, read back in the order they were written.
+// Payloads are optionally compressed in the LZ4 block format. One thread may
+// write while another reads records that have already been written.
+class SpillFile {
+public:
+    SpillFile();
+    ~SpillFile();
+
+    // Pixel rows are stored pixelSize bytes per pixel without padding
+    bool open(const std::string &fname, bool compress, int pixelSize);
+    void close();
+
+    // Returns the number of bytes written, or 0 on failure, in which case
+    // the partial record is discarded
+    size_t write(const Frame &frame, int audioChannels);
+
+    // Returns the number of bytes read, or 0 on failure
+    size_t read(Frame *frame);
+
+    // Starts over at the beginning of the file; only valid once every record
+    // has been read
+    void rewind();
+
+    // Moves the reader to the most recently written record, skipping
+    // anything before it that was not read
+    void skipToLastRecord();
+
+    inline bool isOpen() const { return m_writer != nullptr; }
+
+private:
+    size_t writeRecord(const Frame &frame, int audioChannels);
+    bool writePayload(const uint8_t *data, size_t size, size_t *written);
+    bool readPayload(uint8_t *data, size_t size, size_t *read);
+
+private:
+    std::string m_fname;
+    FILE *m_writer;
+    FILE *m_reader;
+    bool m_compress;
+    int m_pixelSize;
+    int64_t m_recordStart;
+
+    // Used by the writing thread only
+    std::vector<uint8_t> m_rows;
+    std::vector<uint8_t> m_compressed;
+    std::vector<int> m_hashTable;
+
+    // Used by the reading thread only
+    std::vector<uint8_t> m_input;
+    std::vector<uint8_t> m_unpacked;
+};
+} /* namespace atg_dtv */
+
+#endif /* ATG_DIRECT_TO_VIDEO_SPILL_FILE_H */
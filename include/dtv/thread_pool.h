@@ -0,0 +1,62 @@
+#ifndef ATG_DIRECT_TO_VIDEO_THREAD_POOL_H
+#define ATG_DIRECT_TO_VIDEO_THREAD_POOL_H
+
+#include <condition_variable>
+#include <deque>
+#include <functional>
+#include <mutex>
+#include <thread>
+
+namespace atg_dtv {
+// Fixed set of threads sharing one locked task queue, split into a list per
+// thread. Tasks submitted from a pool thread go on its own list, others are
+// spread round-robin; a thread takes from its own list first, then from the
+// others, so that related tasks tend to stay on one thread.
+class ThreadPool {
+public:
+    enum class Priority { Normal, Low };
+    typedef std::function<void()> Task;
+
+public:
+    ThreadPool();
+    ~ThreadPool();
+
+    void initialize(int threadCount, Priority priority = Priority::Normal);
+    void destroy();
+
+    void submit(const Task &task);
+    void wait();
+
+    inline int getThreadCount() const { return m_threadCount; }
+
+    static void setCurrentThreadPriority(Priority priority);
+
+private:
+    // Guarded by m_lock together with m_pending, so that every pending count
+    // has a task in some queue
+    struct WorkerQueue {
+        std::deque<Task> tasks;
+    };
+
+    void worker(int index);
+    Task popTask(int index);
+
+private:
+    std::mutex m_lock;
+    std::condition_variable m_cv;
+    std::condition_variable m_idle;
+
+    std::thread *m_threads;
+    WorkerQueue *m_queues;
+    int m_threadCount;
+    Priority m_priority;
+
+    int m_pending;
+    int m_active;
+    int m_nextQueue;
+
+    bool m_stopped;
+};
+} /* namespace atg_dtv */
+
+#endif /* ATG_DIRECT_TO_VIDEO_THREAD_POOL_H */
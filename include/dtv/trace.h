@@ -0,0 +1,66 @@
+#ifndef ATG_DIRECT_TO_VIDEO_TRACE_H
+#define ATG_DIRECT_TO_VIDEO_TRACE_H
+
+#include <atomic>
+#include <cinttypes>
+#include <string>
+
+namespace atg_dtv {
+class Trace {
+public:
+    struct Event {
+        const char *name;
+        int64_t begin;
+        int64_t end;
+    };
+
+    class Scope {
+    public:
+        // Name must be a string literal or otherwise outlive the trace
+        explicit Scope(const char *name) {
+            m_name = name;
+            m_begin = enabled() ? now() : -1;
+        }
+
+        ~Scope() {
+            if (m_begin >= 0) { record(m_name, m_begin, now()); }
+        }
+
+    private:
+        const char *m_name;
+        int64_t m_begin;
+    };
+
+public:
+    // Starts a new trace; events recorded before the call are discarded
+    static void enable(int eventsPerThread = 1 << 16);
+    static void disable();
+    static inline bool enabled() {
+        return s_enabled.load(std::memory_order_relaxed);
+    }
+
+    // Writes all events recorded so far in Chrome trace JSON format, which can
+    // be opened in chrome://tracing or the Perfetto UI
+    static bool dump(const std::string &fname);
+
+    static void setThreadName(const char *name);
+    static void record(const char *name, int64_t begin, int64_t end);
+    static int64_t now();
+
+private:
+    static std::atomic<bool> s_enabled;
+};
+} /* namespace atg_dtv */
+
+#if defined(DTV_TRACING)
+#define DTV_TRACE_CONCAT_INNER(a, b) a##b
+#define DTV_TRACE_CONCAT(a, b) DTV_TRACE_CONCAT_INNER(a, b)
+#define DTV_TRACE_SCOPE(name)                                                  \
+    atg_dtv::Trace::Scope DTV_TRACE_CONCAT(dtvTraceScope, __LINE__)(name)
+#define DTV_TRACE_THREAD_NAME(name) atg_dtv::Trace::setThreadName(name)
+#else
+#define DTV_TRACE_SCOPE(name) ((void) 0)
+#define DTV_TRACE_THREAD_NAME(name) ((void) 0)
+#endif
+
+#endif /* ATG_DIRECT_TO_VIDEO_TRACE_H */
@@ -0,0 +1,75 @@
+#ifndef ATG_DIRECT_TO_VIDEO_TRANSCODER_H
+#define ATG_DIRECT_TO_VIDEO_TRANSCODER_H
+
+#include "encoder.h"
+
+#include <condition_variable>
+#include <mutex>
+#include <string>
+#include <vector>
+
+struct AVFormatContext;
+struct AVCodecContext;
+struct AVFrame;
+struct AVPacket;
+struct SwsContext;
+
+namespace atg_dtv {
+struct InputStream {
+    AVFormatContext *formatContext = nullptr;
+    AVCodecContext *codecContext = nullptr;
+    int streamIndex = -1;
+    bool eof = false;
+
+    AVFrame *frame = nullptr;
+    AVPacket *packet = nullptr;
+};
+
+class Transcoder {
+public:
+    Transcoder();
+    ~Transcoder();
+
+    void initialize(const std::string &source,
+                    const Encoder::VideoSettings &settings, int bufferSize,
+                    int64_t totalFrames,
+                    const Encoder::TranscodeCallback &callback);
+    void run();
+    void wait();
+
+    bool isComplete();
+    Encoder::Error getError();
+
+    inline const std::string &getSource() const { return m_source; }
+    inline const std::string &getOutputFname() const {
+        return m_settings.fname;
+    }
+
+private:
+    Encoder::Error transcode();
+    Encoder::Error readAudio(int samples);
+    void reportProgress(int64_t frames, bool complete, Encoder::Error error);
+    void destroy();
+
+private:
+    std::mutex m_lock;
+    std::condition_variable m_cv;
+    bool m_complete;
+    Encoder::Error m_error;
+
+    std::string m_source;
+    Encoder::VideoSettings m_settings;
+    int m_bufferSize;
+    int64_t m_totalFrames;
+    Encoder::TranscodeCallback m_callback;
+
+    InputStream m_video, m_audio;
+    SwsContext *m_swsContext;
+
+    std::vector<int16_t> m_audioBuffer;
+    size_t m_audioReadOffset;
+    int m_audioChannels;
+};
+} /* namespace atg_dtv */
+
+#endif /* ATG_DIRECT_TO_VIDEO_TRANSCODER_H */
@@ -0,0 +1,287 @@
+#include "../include/dtv/checkpoint.h"
+
+#include "../include/dtv/ffmpeg.h"
+#include "../include/dtv/keyframe_index.h"
+#include "../include/dtv/trace.h"
+
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+
+#if defined(_WIN32)
+#include <windows.h>
+#endif
+
+bool replaceFile(const std::string &source, const std::string &target) {
+#if defined(_WIN32)
+    return MoveFileExA(source.c_str(), target.c_str(),
+                       MOVEFILE_REPLACE_EXISTING | MOVEFILE_WRITE_THROUGH) != 0;
+#else
+    return rename(source.c_str(), target.c_str()) == 0;
+#endif
+}
+
+std::string readLineValue(const char *line, const char *key) {
+    const size_t keyLength = strlen(key);
+    if (strncmp(line, key, keyLength) != 0 || line[keyLength] != ' ') {
+        return "";
+    }
+
+    std::string value = line + keyLength + 1;
+    while (!value.empty() && (value.back() == '\n' || value.back() == '\r')) {
+        value.pop_back();
+    }
+
+    return value;
+}
+
+bool concatenateSegment(AVFormatContext *output, const std::string &fname,
+                        int frameRate, int64_t frameOffset,
+                        int64_t audioSampleOffset, int64_t *lastDts,
+                        atg_dtv::KeyframeIndex *index, int videoStream) {
+    AVFormatContext *input = nullptr;
+    if (avformat_open_input(&input, fname.c_str(), nullptr, nullptr) < 0) {
+        return false;
+    }
+
+    bool result = avformat_find_stream_info(input, nullptr) >= 0 &&
+                  input->nb_streams == output->nb_streams;
+
+    AVPacket *packet = av_packet_alloc();
+    if (packet == nullptr) { result = false; }
+
+    while (result && av_read_frame(input, packet) >= 0) {
+        const AVStream *inputStream = input->streams[packet->stream_index];
+        const AVStream *outputStream = output->streams[packet->stream_index];
+
+        // Segments restart at zero, so each is shifted by the durable length
+        // of everything before it
+        const int64_t offset =
+                (inputStream->codecpar->codec_type == AVMEDIA_TYPE_AUDIO)
+                        ? av_rescale_q(
+                                  audioSampleOffset,
+                                  AVRational{
+                                          1,
+                                          inputStream->codecpar->sample_rate},
+                                  outputStream->time_base)
+                        : av_rescale_q(frameOffset, AVRational{1, frameRate},
+                                       outputStream->time_base);
+
+        av_packet_rescale_ts(packet, inputStream->time_base,
+                             outputStream->time_base);
+        if (packet->pts != AV_NOPTS_VALUE) { packet->pts += offset; }
+        if (packet->dts != AV_NOPTS_VALUE) { packet->dts += offset; }
+
+        // Encoder delay can make the head of a segment overlap the tail of the
+        // previous one; nudge it forward to keep timestamps monotonic
+        int64_t &last = lastDts[packet->stream_index];
+        if (packet->dts != AV_NOPTS_VALUE && last != AV_NOPTS_VALUE &&
+            packet->dts <= last) {
+            const int64_t shift = last + 1 - packet->dts;
+            packet->dts += shift;
+            if (packet->pts != AV_NOPTS_VALUE) { packet->pts += shift; }
+        }
+
+        if (packet->dts != AV_NOPTS_VALUE) { last = packet->dts; }
+
+        if (packet->stream_index == videoStream && output->pb != nullptr &&
+            (packet->flags & AV_PKT_FLAG_KEY) != 0) {
+            index->record(packet->pts, avio_tell(output->pb));
+        }
+
+        packet->pos = -1;
+        if (av_interleaved_write_frame(output, packet) < 0) { result = false; }
+        av_packet_unref(packet);
+    }
+
+    av_packet_free(&packet);
+    avformat_close_input(&input);
+
+    return result;
+}
+
+atg_dtv::Checkpoint::Checkpoint() {
+    m_frameRate = 0;
+    m_frames = 0;
+    m_audioSamples = 0;
+}
+
+atg_dtv::Checkpoint::~Checkpoint() {}
+
+void atg_dtv::Checkpoint::initialize(const std::string &fname,
+                                     const std::string &manifestFname,
+                                     int frameRate) {
+    m_fname = fname;
+    m_manifestFname = manifestFname;
+    m_frameRate = frameRate;
+    m_segments.clear();
+    m_frames = 0;
+    m_audioSamples = 0;
+}
+
+bool atg_dtv::Checkpoint::load(const std::string &manifestFname) {
+    FILE *file = fopen(manifestFname.c_str(), "r");
+    if (file == nullptr) { return false; }
+
+    initialize("", manifestFname, 0);
+
+    bool valid = false;
+    char line[4096];
+    while (fgets(line, sizeof(line), file) != nullptr) {
+        Segment segment;
+        if (strcmp(line, "dtv-checkpoint 1\n") == 0) {
+            valid = true;
+        } else if (strncmp(line, "output ", 7) == 0) {
+            m_fname = readLineValue(line, "output");
+        } else if (strncmp(line, "frame_rate ", 11) == 0) {
+            m_frameRate = atoi(line + 11);
+        } else if (sscanf(line, "segment %" SCNd64 " %" SCNd64,
+                          &segment.frames, &segment.audioSamples) == 2) {
+            addSegment(segment.frames, segment.audioSamples);
+        }
+    }
+
+    fclose(file);
+
+    return valid && !m_fname.empty() && m_frameRate > 0;
+}
+
+bool atg_dtv::Checkpoint::save() {
+    DTV_TRACE_SCOPE("saveCheckpoint");
+
+    // Write a complete new manifest beside the old one and swap it in, so a
+    // crash leaves either the previous or the next state on disk
+    const std::string tempFname = m_manifestFname + ".tmp";
+    FILE *file = fopen(tempFname.c_str(), "w");
+    if (file == nullptr) { return false; }
+
+    fprintf(file, "dtv-checkpoint 1\n");
+    fprintf(file, "output %s\n", m_fname.c_str());
+    fprintf(file, "frame_rate %d\n", m_frameRate);
+    fprintf(file, "frames %" PRId64 "\n", m_frames);
+    fprintf(file, "audio_samples %" PRId64 "\n", m_audioSamples);
+    for (const Segment &segment : m_segments) {
+        fprintf(file, "segment %" PRId64 " %" PRId64 "\n", segment.frames,
+                segment.audioSamples);
+    }
+
+    const bool written = fflush(file) == 0 && ferror(file) == 0;
+    if (fclose(file) != 0 || !written) { return false; }
+
+    return replaceFile(tempFname, m_manifestFname);
+}
+
+void atg_dtv::Checkpoint::addSegment(int64_t frames, int64_t audioSamples) {
+    m_segments.push_back({frames, audioSamples});
+    m_frames += frames;
+    m_audioSamples += audioSamples;
+}
+
+std::string atg_dtv::Checkpoint::getSegmentFname(int index) const {
+    // Segments keep the output's extension so that the muxer is chosen the
+    // same way for both
+    const size_t separator = m_fname.find_last_of("/\\");
+    const size_t dot = m_fname.find_last_of('.');
+    const std::string extension =
+            (dot != std::string::npos &&
+             (separator == std::string::npos || dot > separator))
+                    ? m_fname.substr(dot)
+                    : "";
+
+    char part[32];
+    snprintf(part, sizeof(part), ".part%04d", index);
+
+    return m_fname + part + extension;
+}
+
+bool atg_dtv::Checkpoint::concatenate(const char *formatName,
+                                      const std::string &indexFname) {
+    DTV_TRACE_SCOPE("concatenateSegments");
+
+    // A session that ended before its first frame
+    if (m_segments.empty()) {
+        removeFiles();
+        return true;
+    }
+
+    AVFormatContext *output = nullptr;
+    avformat_alloc_output_context2(&output, nullptr, formatName,
+                                   m_fname.c_str());
+    if (output == nullptr) { return false; }
+
+    // The first segment provides the stream layout for the whole output
+    AVFormatContext *first = nullptr;
+    bool result = avformat_open_input(&first, getSegmentFname(0).c_str(),
+                                      nullptr, nullptr) >= 0 &&
+                  avformat_find_stream_info(first, nullptr) >= 0;
+
+    for (unsigned int i = 0; result && i < first->nb_streams; ++i) {
+        AVStream *stream = avformat_new_stream(output, nullptr);
+        if (stream == nullptr ||
+            avcodec_parameters_copy(stream->codecpar,
+                                    first->streams[i]->codecpar) < 0) {
+            result = false;
+            break;
+        }
+
+        stream->codecpar->codec_tag = 0;
+        stream->time_base = first->streams[i]->time_base;
+    }
+
+    if (first != nullptr) { avformat_close_input(&first); }
+
+    bool openedFile = false;
+    if (result && (output->oformat->flags & AVFMT_NOFILE) == 0) {
+        openedFile =
+                avio_open(&output->pb, m_fname.c_str(), AVIO_FLAG_WRITE) >= 0;
+        result = openedFile;
+    }
+
+    if (result) { result = avformat_write_header(output, nullptr) >= 0; }
+
+    KeyframeIndex index;
+    int videoStream = -1;
+    if (result && !indexFname.empty()) {
+        for (unsigned int i = 0; i < output->nb_streams; ++i) {
+            if (output->streams[i]->codecpar->codec_type ==
+                AVMEDIA_TYPE_VIDEO) {
+                videoStream = int(i);
+                break;
+            }
+        }
+
+        result = videoStream >= 0 &&
+                 index.open(indexFname,
+                            output->streams[videoStream]->time_base.num,
+                            output->streams[videoStream]->time_base.den);
+    }
+
+    std::vector<int64_t> lastDts(output->nb_streams, AV_NOPTS_VALUE);
+    int64_t frames = 0, audioSamples = 0;
+    for (int i = 0; result && i < getSegmentCount(); ++i) {
+        result = concatenateSegment(output, getSegmentFname(i), m_frameRate,
+                                    frames, audioSamples, lastDts.data(),
+                                    &index, videoStream);
+
+        frames += m_segments[i].frames;
+        audioSamples += m_segments[i].audioSamples;
+    }
+
+    if (result) { result = av_write_trailer(output) == 0; }
+    if (!index.close()) { result = false; }
+
+    if (openedFile) { avio_closep(&output->pb); }
+    avformat_free_context(output);
+
+    if (result) { removeFiles(); }
+
+    return result;
+}
+
+void atg_dtv::Checkpoint::removeFiles() {
+    for (int i = 0; i < getSegmentCount(); ++i) {
+        remove(getSegmentFname(i).c_str());
+    }
+
+    remove(m_manifestFname.c_str());
+}
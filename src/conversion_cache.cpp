@@ -0,0 +1,71 @@
+#include "../include/dtv/conversion_cache.h"
+
+#include "../include/dtv/ffmpeg.h"
+
+atg_dtv::ConversionCache::ConversionCache() {
+    m_capacity = 1;
+    m_clock = 0;
+}
+
+atg_dtv::ConversionCache::~ConversionCache() { destroy(); }
+
+void atg_dtv::ConversionCache::initialize(int capacity) {
+    destroy();
+
+    m_capacity = (capacity > 0) ? capacity : 1;
+    m_clock = 0;
+}
+
+void atg_dtv::ConversionCache::destroy() {
+    for (Entry &entry : m_entries) { sws_freeContext(entry.context); }
+    m_entries.clear();
+}
+
+SwsContext *atg_dtv::ConversionCache::getContext(int srcWidth, int srcHeight,
+                                                 int srcFormat, int dstWidth,
+                                                 int dstHeight, int dstFormat,
+                                                 int flags) {
+    ++m_clock;
+
+    for (Entry &entry : m_entries) {
+        if (entry.srcWidth == srcWidth && entry.srcHeight == srcHeight &&
+            entry.srcFormat == srcFormat && entry.dstWidth == dstWidth &&
+            entry.dstHeight == dstHeight && entry.dstFormat == dstFormat &&
+            entry.flags == flags) {
+            entry.lastUsed = m_clock;
+            return entry.context;
+        }
+    }
+
+    SwsContext *context = sws_getContext(
+            srcWidth, srcHeight, (AVPixelFormat) srcFormat, dstWidth,
+            dstHeight, (AVPixelFormat) dstFormat, flags, nullptr, nullptr,
+            nullptr);
+    if (context == nullptr) { return nullptr; }
+
+    if ((int) m_entries.size() >= m_capacity) {
+        size_t oldest = 0;
+        for (size_t i = 1; i < m_entries.size(); ++i) {
+            if (m_entries[i].lastUsed < m_entries[oldest].lastUsed) {
+                oldest = i;
+            }
+        }
+
+        sws_freeContext(m_entries[oldest].context);
+        m_entries.erase(m_entries.begin() + oldest);
+    }
+
+    Entry entry;
+    entry.srcWidth = srcWidth;
+    entry.srcHeight = srcHeight;
+    entry.srcFormat = srcFormat;
+    entry.dstWidth = dstWidth;
+    entry.dstHeight = dstHeight;
+    entry.dstFormat = dstFormat;
+    entry.flags = flags;
+    entry.context = context;
+    entry.lastUsed = m_clock;
+    m_entries.push_back(entry);
+
+    return context;
+}
@@ -1,36 +1,157 @@
 #include "../include/dtv/encoder.h"
 
+#include "../include/dtv/encoder_pool.h"
 #include "../include/dtv/ffmpeg.h"
+#include "../include/dtv/trace.h"
+#include "../include/dtv/transcoder.h"
+
+#include <algorithm>
+#include <chrono>
+#include <climits>
+#include <cstdio>
+
+// Number of recent frames that latency percentiles are taken over
+const int LatencyWindow = 1024;
+
+atg_dtv::ThreadPool *sharedTranscodePool() {
+    static atg_dtv::ThreadPool pool;
+    static std::once_flag initialized;
+
+    std::call_once(initialized, [] {
+        const int threads =
+                std::max(1, int(std::thread::hardware_concurrency()) / 4);
+        pool.initialize(threads, atg_dtv::ThreadPool::Priority::Low);
+    });
+
+    return &pool;
+}
+
+std::string intermediateFname(const atg_dtv::Encoder::VideoSettings &settings) {
+    return settings.intermediateFname.empty()
+                   ? settings.fname + ".intermediate.mkv"
+                   : settings.intermediateFname;
+}
 
 atg_dtv::Encoder::Encoder() {
     m_stopped = true;
     m_error = Error::None;
     m_worker = nullptr;
+    m_conversionFlags = 0;
+    m_rateControlPending = false;
 }
 
-atg_dtv::Encoder::~Encoder() {}
+atg_dtv::Encoder::~Encoder() {
+    waitTranscode();
+    if (m_prepared) { release(); }
+    destroyStaging();
 
-void atg_dtv::Encoder::run(VideoSettings &settings, int bufferSize) {
-    std::lock_guard<std::mutex> lk(m_lock);
-    if (!m_stopped) { return; }
+    delete m_transcoder;
+    m_transcoder = nullptr;
 
-    m_videoSettings = settings;
-    m_stopped = false;
-    m_error = Error::None;
+    for (Transcoder *transcoder : m_transcoders) { delete transcoder; }
+    m_transcoders.clear();
+}
+
+std::shared_future<atg_dtv::Encoder::Error>
+atg_dtv::Encoder::run(VideoSettings &settings, int bufferSize) {
+    retireTranscodes(settings);
 
-    m_queue.initialize(bufferSize);
+    std::lock_guard<std::mutex> lk(m_lock);
+    if (!m_stopped) { return m_ready; }
+    if (m_prepared) { release(); }
 
-    setup();
+    m_promise = std::promise<Error>();
+    m_ready = m_promise.get_future().share();
 
-    if (m_error == Error::None) {
+    m_error = initializeSession(settings, bufferSize);
+    if (m_error != Error::None) {
+        m_stopped = true;
+        m_complete = true;
+        m_queue.stop();
+        m_promise.set_value(m_error);
+    } else if (m_videoSettings.remote) {
+        m_worker = new std::thread(&atg_dtv::Encoder::supervise, this);
+    } else if (m_scheduler == nullptr) {
         m_worker = new std::thread(&atg_dtv::Encoder::worker, this);
+    }
+
+    return m_ready;
+}
+
+atg_dtv::Encoder::Error atg_dtv::Encoder::prepare(VideoSettings &settings,
+                                                  int bufferSize) {
+    retireTranscodes(settings);
+
+    // A remote session's output is opened by the encoder process
+    if (settings.remote) { return Error::RemoteNotSupported; }
+
+    std::unique_lock<std::mutex> lk(m_lock);
+    if (!m_stopped) { return Error::AlreadyRunning; }
+
+    // A pool opens the output on its own threads as part of EncoderPool::run()
+    if (m_scheduler != nullptr) { return Error::PoolNotSupported; }
+    if (m_prepared) { release(); }
+
+    // The session counts as running from here on, so the lock doesn't have
+    // to be held while the codecs open
+    Error err = initializeSession(settings, bufferSize);
+    if (err == Error::None) {
+        lk.unlock();
+        err = startup();
+        lk.lock();
+    }
+
+    // Nothing is encoded until start()
+    m_stopped = true;
+    m_complete = true;
+
+    if (err != Error::None) {
+        m_error = err;
+        release();
     } else {
-        destroy();
+        m_prepared = true;
+    }
+
+    return err;
+}
+
+std::shared_future<atg_dtv::Encoder::Error> atg_dtv::Encoder::start() {
+    std::lock_guard<std::mutex> lk(m_lock);
+
+    m_promise = std::promise<Error>();
+    m_ready = m_promise.get_future().share();
+
+    if (!m_prepared) {
+        m_promise.set_value(Error::NotPrepared);
+        return m_ready;
     }
+
+    m_prepared = false;
+    m_stopped = false;
+    m_complete = false;
+    m_promise.set_value(Error::None);
+
+    m_worker = new std::thread(&atg_dtv::Encoder::worker, this);
+
+    return m_ready;
+}
+
+bool atg_dtv::Encoder::resume(const std::string &checkpointFname) {
+    std::lock_guard<std::mutex> lk(m_lock);
+    if (!m_stopped) { return false; }
+
+    m_resume = m_checkpoint.load(checkpointFname);
+    m_resumeFrame = m_resume ? m_checkpoint.getFrames() : 0;
+
+    return m_resume;
 }
 
 atg_dtv::Encoder::Error atg_dtv::Encoder::getError() {
     std::lock_guard<std::mutex> lk(m_lock);
+    if (m_error == Error::None && m_transcoder != nullptr) {
+        return m_transcoder->getError();
+    }
+
     return m_error;
 }
 
@@ -41,6 +162,8 @@ void atg_dtv::Encoder::commit() {
     }
 
     m_queue.stop();
+
+    if (m_scheduler != nullptr) { m_scheduler->notify(this); }
 }
 
 void atg_dtv::Encoder::stop() {
@@ -51,37 +174,468 @@ void atg_dtv::Encoder::stop() {
         m_worker = nullptr;
     }
 
-    m_queue.destroy();
+    if (m_scheduler != nullptr) {
+        std::unique_lock<std::mutex> lk(m_lock);
+        m_completeCv.wait(lk, [this] { return m_complete; });
+        m_scheduler = nullptr;
+    }
+
+    release();
 }
 
 atg_dtv::Frame *atg_dtv::Encoder::newFrame(bool wait) {
-    int64_t audioSamples = 0;
-    if (m_videoSettings.audio) {
-        const int64_t frameAudioSamples = m_audioStream.tempFrame->nb_samples;
-        while (av_compare_ts(m_videoStream.writePts + 1,
-                             m_videoStream.codecContext->time_base,
-                             m_audioStream.writePts + audioSamples,
-                             m_audioStream.codecContext->time_base) > 0) {
-            audioSamples += frameAudioSamples;
-        }
+    return newFrame(m_videoSettings.inputWidth, m_videoSettings.inputHeight,
+                    wait);
+}
 
-        m_audioStream.writePts += audioSamples;
+atg_dtv::Frame *atg_dtv::Encoder::newFrame(int width, int height, bool wait) {
+    // Each frame carries exactly its own span of audio; the encoder thread
+    // regroups it into codec-sized frames, so the producer does not depend on
+    // the codec being open yet
+    const int64_t frameIndex = m_videoStream.writePts;
+    const int64_t audioSamples =
+            m_videoSettings.audio
+                    ? av_rescale(frameIndex + 1, m_audioSampleRate,
+                                 m_videoSettings.frameRate) -
+                              av_rescale(frameIndex, m_audioSampleRate,
+                                         m_videoSettings.frameRate)
+                    : 0;
+
+    const int pixelSize = m_videoSettings.inputAlpha ? 4 : 3;
+    const int lineWidth =
+            (width == m_videoSettings.inputWidth || m_lineWidth == 0)
+                    ? m_lineWidth
+                    : FFALIGN(width * pixelSize, 64);
+
+    DTV_TRACE_SCOPE("newFrame");
+    if (!m_videoSettings.convertOnSubmit) {
+        Frame *frame = m_queue.newFrame(width, height, lineWidth, audioSamples,
+                                        m_audioChannels, wait);
+        if (frame != nullptr) { ++m_videoStream.writePts; }
+
+        m_pendingFrame = frame;
+        return frame;
     }
 
+    // The producer draws into a staging frame and only the converted pixels
+    // are queued
+    Frame *frame = m_queue.newFrame(width, height, 0, audioSamples,
+                                    m_audioChannels, wait, m_convertedSize);
+    if (frame == nullptr) { return nullptr; }
+
     ++m_videoStream.writePts;
-    Frame *frame = m_queue.newFrame(m_videoSettings.inputWidth,
-                                    m_videoSettings.inputHeight, m_lineWidth,
-                                    audioSamples,
-                                    m_audioStream.codecContext->channels, wait);
-    return frame;
+
+    if (lineWidth > 0 &&
+        (m_staging.m_rgb == nullptr || m_staging.m_maxWidth < width ||
+         m_staging.m_maxHeight < height)) {
+        delete[] m_staging.m_rgb;
+        m_staging.m_rgb = new uint8_t[size_t(height) * size_t(lineWidth)];
+        m_staging.m_maxWidth = width;
+        m_staging.m_maxHeight = height;
+        m_staging.m_lineWidth = lineWidth;
+    }
+
+    m_staging.m_width = width;
+    m_staging.m_height = height;
+    m_staging.m_flip = false;
+    m_staging.m_keyframe = false;
+
+    // Audio is written straight into the queued frame's buffer
+    std::swap(m_staging.m_audio, frame->m_audio);
+    std::swap(m_staging.m_audioCapacity, frame->m_audioCapacity);
+    m_staging.m_audioSamples = frame->m_audioSamples;
+
+    m_pendingFrame = frame;
+    return &m_staging;
+}
+
+void atg_dtv::Encoder::submitFrame() {
+    DTV_TRACE_SCOPE("submitFrame");
+
+    // Nothing was handed out by newFrame(), or it was already submitted
+    Frame *frame = m_pendingFrame;
+    m_pendingFrame = nullptr;
+    if (frame == nullptr) { return; }
+
+    frame->m_submitTime = std::chrono::steady_clock::now();
+
+    if (m_videoSettings.convertOnSubmit) {
+        std::swap(m_staging.m_audio, frame->m_audio);
+        std::swap(m_staging.m_audioCapacity, frame->m_audioCapacity);
+        frame->m_keyframe = m_staging.m_keyframe;
+        frame->m_width = m_videoSettings.width;
+        frame->m_height = m_videoSettings.height;
+
+        const Error err = convertFrame(&m_staging, frame);
+        m_staging.releaseExternalBuffer();
+
+        // The frame is dropped rather than queued with bad pixels
+        if (err != Error::None) {
+            std::lock_guard<std::mutex> lk(m_lock);
+            if (m_error == Error::None) { m_error = err; }
+            return;
+        }
+    }
+
+    if (!m_queue.submitFrame()) {
+        std::lock_guard<std::mutex> lk(m_lock);
+        if (m_error == Error::None) { m_error = Error::CouldNotSpillFrame; }
+    }
+
+    if (m_scheduler != nullptr) { m_scheduler->notify(this); }
+}
+
+atg_dtv::Encoder::Error
+atg_dtv::Encoder::reconfigure(const RateControl &rateControl) {
+    if (rateControl.bitRate <= 0 || rateControl.maxBitRate < 0 ||
+        rateControl.vbvBufferSize < 0) {
+        return Error::InvalidRateControl;
+    }
+
+    std::shared_future<Error> ready;
+    {
+        std::lock_guard<std::mutex> lk(m_lock);
+        if (m_stopped && !m_prepared) { return Error::NotRunning; }
+        if (!m_prepared) { ready = m_ready; }
+    }
+
+    // Support depends on the codec that startup() opened
+    if (ready.valid() && ready.get() != Error::None) { return ready.get(); }
+
+    std::lock_guard<std::mutex> lk(m_lock);
+    if (m_rateControlMode == RateControlMode::Unsupported) {
+        return Error::ReconfigureNotSupported;
+    }
+
+    // x264 would silently keep the old bitrate once VBV is off
+    if (m_rateControlMode == RateControlMode::LiveVbv &&
+        (rateControl.maxBitRate <= 0 || rateControl.vbvBufferSize <= 0)) {
+        return Error::InvalidRateControl;
+    }
+
+    m_rateControl = rateControl;
+    m_rateControlPending = true;
+
+    return Error::None;
+}
+
+atg_dtv::Encoder::Error atg_dtv::Encoder::setBitrate(int bitRate) {
+    RateControl rateControl;
+    {
+        std::lock_guard<std::mutex> lk(m_lock);
+        rateControl = m_rateControl;
+    }
+
+    rateControl.bitRate = bitRate;
+    return reconfigure(rateControl);
+}
+
+void atg_dtv::Encoder::setTranscodeCallback(
+        const TranscodeCallback &callback) {
+    std::lock_guard<std::mutex> lk(m_lock);
+    m_transcodeCallback = callback;
+}
+
+void atg_dtv::Encoder::waitTranscode() {
+    std::vector<Transcoder *> transcoders;
+    {
+        std::lock_guard<std::mutex> lk(m_lock);
+        transcoders = m_transcoders;
+        if (m_transcoder != nullptr) { transcoders.push_back(m_transcoder); }
+    }
+
+    // They are only freed by run(), prepare() and the destructor, none of
+    // which may overlap with this call
+    for (Transcoder *transcoder : transcoders) { transcoder->wait(); }
+}
+
+bool atg_dtv::Encoder::transcoding() {
+    std::lock_guard<std::mutex> lk(m_lock);
+    if (m_transcoder != nullptr && !m_transcoder->isComplete()) { return true; }
+
+    for (Transcoder *transcoder : m_transcoders) {
+        if (!transcoder->isComplete()) { return true; }
+    }
+
+    return false;
+}
+
+void atg_dtv::Encoder::retireTranscodes(const VideoSettings &settings) {
+    const std::string intermediate =
+            settings.intermediate ? intermediateFname(settings) : "";
+
+    std::vector<Transcoder *> conflicting;
+    {
+        std::lock_guard<std::mutex> lk(m_lock);
+
+        // A session that is still running keeps its transcode
+        if (!m_stopped) { return; }
+
+        if (m_transcoder != nullptr) {
+            m_transcoders.push_back(m_transcoder);
+            m_transcoder = nullptr;
+        }
+
+        auto it = m_transcoders.begin();
+        while (it != m_transcoders.end()) {
+            Transcoder *transcoder = *it;
+            if (transcoder->isComplete()) {
+                delete transcoder;
+                it = m_transcoders.erase(it);
+                continue;
+            }
+
+            const std::string &source = transcoder->getSource();
+            const std::string &output = transcoder->getOutputFname();
+            if (settings.fname == source || settings.fname == output ||
+                intermediate == source || intermediate == output) {
+                conflicting.push_back(transcoder);
+            }
+
+            ++it;
+        }
+    }
+
+    for (Transcoder *transcoder : conflicting) { transcoder->wait(); }
+}
+
+atg_dtv::LatencyStats::Summary atg_dtv::Encoder::getLatency() {
+    if (m_videoSettings.remote) {
+        std::lock_guard<std::mutex> lk(m_lock);
+        return m_remoteLatency;
+    }
+
+    return m_latency.getSummary();
+}
+
+void atg_dtv::Encoder::setSpeedCallback(
+        const SpeedGovernor::Callback &callback) {
+    std::lock_guard<std::mutex> lk(m_lock);
+    m_speedCallback = callback;
+}
+
+const char *encoderPreset(const AVCodec *codec,
+                          const atg_dtv::SpeedGovernor::Level &level) {
+    if (strcmp(codec->name, "libx264") == 0) {
+        return level.x264Preset;
+    } else if (strstr(codec->name, "nvenc") != nullptr) {
+        return level.nvencPreset;
+    } else {
+        return nullptr;
+    }
+}
+
+void setEncoderPreset(AVCodecContext *codecContext, const AVCodec *codec,
+                      atg_dtv::Encoder::VideoSettings &settings,
+                      int speedLevel) {
+    const char *preset = nullptr;
+    if (settings.adaptiveSpeed) {
+        preset = encoderPreset(
+                codec, atg_dtv::SpeedGovernor::getLevelSettings(speedLevel));
+    } else if (strcmp(codec->name, "libx264") == 0) {
+        preset = "ultrafast";
+    }
+
+    if (preset != nullptr) {
+        av_opt_set(codecContext->priv_data, "preset", preset, 0);
+    }
+
+    if (strcmp(codec->name, "libx264") == 0) {
+        av_opt_set(codecContext->priv_data, "tune", "zerolatency", 0);
+    }
+}
+
+bool supportsLiveRateControl(const AVCodec *codec,
+                             const AVCodecContext *codecContext) {
+    // These wrappers pick up bit_rate and VBV changes on the next frame, but
+    // x264_encoder_reconfig() ignores the bitrate unless VBV was on at open
+    if (strcmp(codec->name, "libx264") == 0) {
+        return codecContext->rc_max_rate > 0 &&
+               codecContext->rc_buffer_size > 0;
+    }
+
+    return strstr(codec->name, "nvenc") != nullptr;
+}
+
+void setLowLatencyOptions(AVCodecContext *codecContext, const AVCodec *codec) {
+    // Rows are refreshed over a rolling window of frames rather than with
+    // periodic IDR frames, which keeps packet sizes even
+    if (strcmp(codec->name, "libx264") == 0) {
+        av_opt_set_int(codecContext->priv_data, "rc-lookahead", 0, 0);
+        av_opt_set_int(codecContext->priv_data, "intra-refresh", 1, 0);
+    } else if (strstr(codec->name, "nvenc") != nullptr) {
+        av_opt_set_int(codecContext->priv_data, "zerolatency", 1, 0);
+        av_opt_set_int(codecContext->priv_data, "rc-lookahead", 0, 0);
+        av_opt_set_int(codecContext->priv_data, "delay", 0, 0);
+        av_opt_set_int(codecContext->priv_data, "intra-refresh", 1, 0);
+    }
+}
+
+void setKeyframeOptions(AVCodecContext *codecContext, const AVCodec *codec) {
+    // Forced keyframes should be IDR frames so that decoding can start there
+    if (strcmp(codec->name, "libx264") == 0 ||
+        strstr(codec->name, "nvenc") != nullptr) {
+        av_opt_set_int(codecContext->priv_data, "forced-idr", 1, 0);
+    }
+}
+
+AVPixelFormat
+inputPixelFormat(const atg_dtv::Encoder::VideoSettings &settings) {
+    return (settings.inputAlpha)
+                   ? (settings.bgr ? AV_PIX_FMT_BGRA : AV_PIX_FMT_RGBA)
+                   : (settings.bgr ? AV_PIX_FMT_BGR24 : AV_PIX_FMT_RGB24);
+}
+
+AVCodecID intermediateCodecId(atg_dtv::Encoder::IntermediateCodec codec) {
+    switch (codec) {
+        case atg_dtv::Encoder::IntermediateCodec::FFV1:
+            return AV_CODEC_ID_FFV1;
+        case atg_dtv::Encoder::IntermediateCodec::UtVideo:
+            return AV_CODEC_ID_UTVIDEO;
+        case atg_dtv::Encoder::IntermediateCodec::Raw:
+        default:
+            return AV_CODEC_ID_RAWVIDEO;
+    }
+}
+
+AVPixelFormat
+videoPixelFormat(const AVCodec *codec,
+                 const atg_dtv::Encoder::VideoSettings &settings) {
+    if (!settings.intermediate) { return AV_PIX_FMT_YUV420P; }
+
+    // Keep the producer's pixel layout where the codec allows it so that
+    // conversion is at most a plane shuffle
+    const AVPixelFormat inputFormat = inputPixelFormat(settings);
+    return (codec->pix_fmts != nullptr)
+                   ? avcodec_find_best_pix_fmt_of_list(codec->pix_fmts,
+                                                       inputFormat,
+                                                       settings.inputAlpha,
+                                                       nullptr)
+                   : inputFormat;
+}
+
+int selectSampleRate(const AVCodec *codec) {
+    int sampleRate = 44100;
+    if (codec->supported_samplerates) {
+        sampleRate = codec->supported_samplerates[0];
+        for (uint64_t i = 0; codec->supported_samplerates[i]; i++) {
+            if (codec->supported_samplerates[i] == 44100) sampleRate = 44100;
+        }
+    }
+
+    return sampleRate;
+}
+
+uint64_t selectChannelLayout(const AVCodec *codec) {
+    uint64_t channelLayout = AV_CH_LAYOUT_STEREO;
+    if (codec->channel_layouts) {
+        channelLayout = codec->channel_layouts[0];
+        for (uint64_t i = 0; codec->channel_layouts[i]; i++) {
+            if (codec->channel_layouts[i] == AV_CH_LAYOUT_STEREO)
+                channelLayout = AV_CH_LAYOUT_STEREO;
+        }
+    }
+
+    return channelLayout;
+}
+
+atg_dtv::Encoder::Error
+resolveOutputFormats(const atg_dtv::Encoder::VideoSettings &settings,
+                     AVPixelFormat *pixelFormat, int *sampleRate,
+                     int *channels) {
+    typedef atg_dtv::Encoder::Error Error;
+
+    // Makes the same choices as Encoder::setup() without opening anything
+    const AVOutputFormat *format =
+            av_guess_format(settings.intermediate ? "matroska" : nullptr,
+                            settings.fname.c_str(), nullptr);
+    if (format == nullptr) { return Error::CouldNotAllocateOutputContext; }
+
+    const AVCodecID videoCodecId =
+            settings.intermediate
+                    ? intermediateCodecId(settings.intermediateCodec)
+                    : format->video_codec;
+    if (videoCodecId == AV_CODEC_ID_NONE) { return Error::NotAVideoFormat; }
+
+    const AVCodec *videoCodec = avcodec_find_encoder(videoCodecId);
+    if (videoCodec == nullptr) { return Error::CouldNotFindEncoder; }
+
+    *pixelFormat = videoPixelFormat(videoCodec, settings);
+
+    if (settings.audio) {
+        const AVCodec *audioCodec = avcodec_find_encoder(
+                settings.intermediate ? AV_CODEC_ID_PCM_S16LE
+                                      : format->audio_codec);
+        if (audioCodec == nullptr) { return Error::CouldNotFindEncoder; }
+
+        *sampleRate = selectSampleRate(audioCodec);
+        *channels = av_get_channel_layout_nb_channels(
+                selectChannelLayout(audioCodec));
+    }
+
+    return Error::None;
+}
+
+void configureIntermediateContext(AVCodecContext *codecContext) {
+    codecContext->thread_count = 0;
+    if (codecContext->codec_id == AV_CODEC_ID_FFV1) {
+        codecContext->level = 3;
+        codecContext->slices = 16;
+        codecContext->gop_size = 1;
+        av_opt_set_int(codecContext->priv_data, "slicecrc", 0, 0);
+    } else if (codecContext->codec_id == AV_CODEC_ID_UTVIDEO) {
+        av_opt_set(codecContext->priv_data, "pred", "left", 0);
+    }
 }
 
-void atg_dtv::Encoder::submitFrame() { m_queue.submitFrame(); }
+void configureVideoContext(AVCodecContext *codecContext, AVCodecID codecId,
+                           const AVCodec *codec,
+                           atg_dtv::Encoder::VideoSettings &settings) {
+    codecContext->codec_id = codecId;
+    codecContext->bit_rate = settings.bitRate;
+    if (settings.maxBitRate > 0) {
+        codecContext->rc_max_rate = settings.maxBitRate;
+    }
+    if (settings.vbvBufferSize > 0) {
+        codecContext->rc_buffer_size = settings.vbvBufferSize;
+    }
+    codecContext->width = settings.width;
+    codecContext->height = settings.height;
+    codecContext->time_base = AVRational{1, settings.frameRate};
+
+    // Keyframes are placed on request; the interval only bounds seek cost
+    codecContext->gop_size = (settings.keyframeInterval > 0)
+                                     ? settings.keyframeInterval
+                                     : 10 * settings.frameRate;
+    codecContext->pix_fmt = videoPixelFormat(codec, settings);
+
+    if (codecContext->codec_id == AV_CODEC_ID_MPEG2VIDEO) {
+        codecContext->max_b_frames = 2;
+    } else if (codecContext->codec_id == AV_CODEC_ID_MPEG1VIDEO) {
+        codecContext->mb_decision = 2;
+    }
+
+    if (settings.lowLatency) {
+        // Packets leave the codec with the frame that produced them
+        codecContext->max_b_frames = 0;
+        codecContext->thread_type = FF_THREAD_SLICE;
+        codecContext->gop_size = (settings.keyframeInterval > 0)
+                                         ? settings.keyframeInterval
+                                         : settings.frameRate;
+    }
+
+    if (settings.intermediate) { configureIntermediateContext(codecContext); }
+
+    if (settings.codecThreads > 0) {
+        codecContext->thread_count = settings.codecThreads;
+    }
+}
 
 atg_dtv::Encoder::Error addStream(atg_dtv::OutputStream *ost,
                                   AVFormatContext *oc, const AVCodec **codec,
                                   AVCodecID codecId,
-                                  atg_dtv::Encoder::VideoSettings &settings) {
+                                  atg_dtv::Encoder::VideoSettings &settings,
+                                  int speedLevel) {
     typedef atg_dtv::Encoder::Error Error;
 
     AVCodecContext *codecContext;
@@ -109,9 +663,10 @@ atg_dtv::Encoder::Error addStream(atg_dtv::OutputStream *ost,
 
     ost->codecContext = codecContext;
 
-    if (strcmp((*codec)->name, "libx264") == 0) {
-        av_opt_set(ost->codecContext->priv_data, "preset", "ultrafast", 0);
-        av_opt_set(ost->codecContext->priv_data, "tune", "zerolatency", 0);
+    if ((*codec)->type == AVMEDIA_TYPE_VIDEO) {
+        setEncoderPreset(codecContext, *codec, settings, speedLevel);
+        setKeyframeOptions(codecContext, *codec);
+        if (settings.lowLatency) { setLowLatencyOptions(codecContext, *codec); }
     }
 
     switch ((*codec)->type) {
@@ -120,48 +675,16 @@ atg_dtv::Encoder::Error addStream(atg_dtv::OutputStream *ost,
                                                ? (*codec)->sample_fmts[0]
                                                : AV_SAMPLE_FMT_FLTP;
             codecContext->bit_rate = 256000;
-            codecContext->sample_rate = 44100;
-            if ((*codec)->supported_samplerates) {
-                codecContext->sample_rate = (*codec)->supported_samplerates[0];
-                for (uint64_t i = 0; (*codec)->supported_samplerates[i]; i++) {
-                    if ((*codec)->supported_samplerates[i] == 44100)
-                        codecContext->sample_rate = 44100;
-                }
-            }
-
-            codecContext->channels = av_get_channel_layout_nb_channels(
-                    codecContext->channel_layout);
-            codecContext->channel_layout = AV_CH_LAYOUT_STEREO;
-            if ((*codec)->channel_layouts) {
-                codecContext->channel_layout = (*codec)->channel_layouts[0];
-                for (uint64_t i = 0; (*codec)->channel_layouts[i]; i++) {
-                    if ((*codec)->channel_layouts[i] == AV_CH_LAYOUT_STEREO)
-                        codecContext->channel_layout = AV_CH_LAYOUT_STEREO;
-                }
-            }
-
+            codecContext->sample_rate = selectSampleRate(*codec);
+            codecContext->channel_layout = selectChannelLayout(*codec);
             codecContext->channels = av_get_channel_layout_nb_channels(
                     codecContext->channel_layout);
             ost->av_stream->time_base =
                     AVRational{1, codecContext->sample_rate};
             break;
         case AVMEDIA_TYPE_VIDEO:
-            codecContext->codec_id = codecId;
-            codecContext->bit_rate = settings.bitRate;
-            codecContext->width = settings.width;
-            codecContext->height = settings.height;
-
-            ost->av_stream->time_base = AVRational{1, settings.frameRate};
-            codecContext->time_base = ost->av_stream->time_base;
-
-            codecContext->gop_size = 12;
-            codecContext->pix_fmt = AV_PIX_FMT_YUV420P;
-
-            if (codecContext->codec_id == AV_CODEC_ID_MPEG2VIDEO) {
-                codecContext->max_b_frames = 2;
-            } else if (codecContext->codec_id == AV_CODEC_ID_MPEG1VIDEO) {
-                codecContext->mb_decision = 2;
-            }
+            configureVideoContext(codecContext, codecId, *codec, settings);
+            ost->av_stream->time_base = codecContext->time_base;
             break;
         default:
             return Error::UnsupportedMediaType;
@@ -181,8 +704,12 @@ void freeStream(atg_dtv::OutputStream *ost) {
     if (ost->frame != nullptr) { av_frame_free(&ost->frame); }
     if (ost->tempFrame != nullptr) { av_frame_free(&ost->tempFrame); }
     if (ost->tempPacket != nullptr) { av_packet_free(&ost->tempPacket); }
-    if (ost->swsContext != nullptr) { sws_freeContext(ost->swsContext); }
+    ost->conversionCache.destroy();
     if (ost->swrContext != nullptr) { swr_free(&ost->swrContext); }
+
+    ost->av_stream = nullptr;
+    ost->nextPts = 0;
+    ost->audioSamples = 0;
 }
 
 AVFrame *allocateAudioFrame(AVSampleFormat sampleFormat, uint64_t channelLayout,
@@ -202,23 +729,23 @@ AVFrame *allocateAudioFrame(AVSampleFormat sampleFormat, uint64_t channelLayout,
     return frame;
 }
 
+int audioFrameSize(const AVCodecContext *codecContext) {
+    return ((codecContext->codec->capabilities &
+             AV_CODEC_CAP_VARIABLE_FRAME_SIZE) != 0)
+                   ? 10000
+                   : codecContext->frame_size;
+}
+
 atg_dtv::Encoder::Error
 openAudioStream(AVFormatContext *, const AVCodec *codec,
-                atg_dtv::OutputStream *ost,
-                atg_dtv::Encoder::VideoSettings &settings) {
+                atg_dtv::OutputStream *ost) {
     typedef atg_dtv::Encoder::Error Error;
 
     if (avcodec_open2(ost->codecContext, codec, nullptr) < 0) {
         return Error::CouldNotOpenVideoCodec;
     }
 
-    int nb_samples = 0;
-    if ((ost->codecContext->codec->capabilities &
-         AV_CODEC_CAP_VARIABLE_FRAME_SIZE) != 0) {
-        nb_samples = 10000;
-    } else {
-        nb_samples = ost->codecContext->frame_size;
-    }
+    const int nb_samples = audioFrameSize(ost->codecContext);
 
     ost->frame = allocateAudioFrame(ost->codecContext->sample_fmt,
                                     ost->codecContext->channel_layout,
@@ -262,19 +789,54 @@ openAudioStream(AVFormatContext *, const AVCodec *codec,
     return Error::None;
 }
 
-int copyAudioData(atg_dtv::Frame *src,
-                  atg_dtv::Encoder::VideoSettings &settings,
-                  atg_dtv::OutputStream *ost, int readOffset) {
-    const int pixelSize =
-            settings.inputAlpha ? (4 * sizeof(uint8_t)) : (3 * sizeof(uint8_t));
-    memcpy(ost->tempFrame->data[0], src->m_audio + readOffset,
-           size_t(sizeof(uint16_t) * ost->codecContext->channels *
-                  ost->tempFrame->nb_samples));
+atg_dtv::Encoder::Error writeFrame(AVFormatContext *oc,
+                                   atg_dtv::OutputStream *ost, AVFrame *frame,
+                                   atg_dtv::KeyframeIndex *index = nullptr,
+                                   atg_dtv::LatencyStats *latency = nullptr) {
+    typedef atg_dtv::Encoder::Error Error;
+
+    AVCodecContext *codecContext = ost->codecContext;
+    {
+        DTV_TRACE_SCOPE("avcodec_send_frame");
+        if (avcodec_send_frame(codecContext, frame) < 0) {
+            return Error::CouldNotSendFrameToEncoder;
+        }
+    }
+
+    while (true) {
+        int r;
+        {
+            DTV_TRACE_SCOPE("avcodec_receive_packet");
+            r = avcodec_receive_packet(codecContext, ost->tempPacket);
+        }
+
+        if (r == AVERROR(EAGAIN) || r == AVERROR_EOF) {
+            break;
+        } else if (r < 0) {
+            return Error::CouldNotEncodeFrame;
+        }
+
+        const int64_t pts = ost->tempPacket->pts;
+        av_packet_rescale_ts(ost->tempPacket, codecContext->time_base,
+                             ost->av_stream->time_base);
+        ost->tempPacket->stream_index = ost->av_stream->index;
+
+        // The muxer may hold the packet back for interleaving, so the current
+        // position is at or before where its data ends up
+        if (index != nullptr && oc->pb != nullptr &&
+            (ost->tempPacket->flags & AV_PKT_FLAG_KEY) != 0) {
+            index->record(ost->tempPacket->pts, avio_tell(oc->pb));
+        }
+
+        DTV_TRACE_SCOPE("av_interleaved_write_frame");
+        if (av_interleaved_write_frame(oc, ost->tempPacket) < 0) {
+            return Error::CouldNotWriteOutputPacket;
+        }
 
-    ost->frame->pts = ost->nextPts;
-    ost->nextPts += ost->tempFrame->nb_samples;
+        if (latency != nullptr) { latency->end(pts); }
+    }
 
-    return ost->tempFrame->nb_samples;
+    return Error::None;
 }
 
 atg_dtv::Encoder::Error writeAudioFrame(AVFormatContext *oc,
@@ -283,76 +845,40 @@ atg_dtv::Encoder::Error writeAudioFrame(AVFormatContext *oc,
 
     AVCodecContext *c = ost->codecContext;
     AVFrame *frame = ost->tempFrame;
-    const int dstNbSamples = av_rescale_rnd(
-            swr_get_delay(ost->swrContext, c->sample_rate) + frame->nb_samples,
-            c->sample_rate, c->sample_rate, AV_ROUND_UP);
+    const int capacity = audioFrameSize(c);
 
+    // A short final frame shrinks nb_samples, so restore the full size before
+    // a new buffer may be allocated
+    ost->frame->nb_samples = capacity;
     if (av_frame_make_writable(ost->frame) < 0) {
         return Error::CouldNotEncodeFrame;
     }
 
-    if (swr_convert(ost->swrContext, ost->frame->data, dstNbSamples,
-                    (const uint8_t **) frame->data, frame->nb_samples) < 0) {
-        return Error::CouldNotEncodeFrame;
+    int samples;
+    {
+        DTV_TRACE_SCOPE("swr_convert");
+        samples = swr_convert(ost->swrContext, ost->frame->data, capacity,
+                              (const uint8_t **) frame->data,
+                              frame->nb_samples);
+        if (samples < 0) { return Error::CouldNotEncodeFrame; }
     }
 
+    if (samples == 0) { return Error::None; }
+
+    ost->frame->nb_samples = samples;
     ost->frame->pts = av_rescale_q(ost->audioSamples,
                                    AVRational{1, c->sample_rate}, c->time_base);
-    ost->audioSamples += dstNbSamples;
+    ost->audioSamples += samples;
 
-    {
-        AVCodecContext *codecContext = ost->codecContext;
-        if (avcodec_send_frame(codecContext, ost->frame) < 0) {
-            return Error::CouldNotSendFrameToEncoder;
-        }
-
-        while (true) {
-            const int r = avcodec_receive_packet(codecContext, ost->tempPacket);
-            if (r == AVERROR(EAGAIN) || r == AVERROR_EOF) {
-                break;
-            } else if (r < 0) {
-                return Error::CouldNotEncodeFrame;
-            }
-
-            av_packet_rescale_ts(ost->tempPacket, codecContext->time_base,
-                                 ost->av_stream->time_base);
-            ost->tempPacket->stream_index = ost->av_stream->index;
-
-            if (av_interleaved_write_frame(oc, ost->tempPacket) < 0) {
-                return Error::CouldNotWriteOutputPacket;
-            }
-        }
-    }
-
-    return Error::None;
+    DTV_TRACE_SCOPE("writeAudioFrame");
+    return writeFrame(oc, ost, ost->frame);
 }
 
-atg_dtv::Encoder::Error flush(AVFormatContext *oc, atg_dtv::OutputStream *ost) {
-    using Error = atg_dtv::Encoder::Error;
-
-    AVCodecContext *codecContext = ost->codecContext;
-    if (avcodec_send_frame(codecContext, nullptr) < 0) {
-        return Error::CouldNotSendFrameToEncoder;
-    }
-
-    while (true) {
-        const int r = avcodec_receive_packet(codecContext, ost->tempPacket);
-        if (r == AVERROR(EAGAIN) || r == AVERROR_EOF) {
-            break;
-        } else if (r < 0) {
-            return Error::CouldNotEncodeFrame;
-        }
-
-        av_packet_rescale_ts(ost->tempPacket, codecContext->time_base,
-                             ost->av_stream->time_base);
-        ost->tempPacket->stream_index = ost->av_stream->index;
-
-        if (av_interleaved_write_frame(oc, ost->tempPacket) < 0) {
-            return Error::CouldNotWriteOutputPacket;
-        }
-    }
-
-    return Error::None;
+atg_dtv::Encoder::Error flush(AVFormatContext *oc, atg_dtv::OutputStream *ost,
+                              atg_dtv::KeyframeIndex *index = nullptr,
+                              atg_dtv::LatencyStats *latency = nullptr) {
+    if (ost->codecContext == nullptr) { return atg_dtv::Encoder::Error::None; }
+    return writeFrame(oc, ost, nullptr, index, latency);
 }
 
 AVFrame *allocateVideoFrame(AVPixelFormat pixelFormat, int width, int height) {
@@ -368,10 +894,29 @@ AVFrame *allocateVideoFrame(AVPixelFormat pixelFormat, int width, int height) {
     return frame;
 }
 
+atg_dtv::Encoder::Error
+createConversionContext(atg_dtv::OutputStream *ost,
+                        atg_dtv::Encoder::VideoSettings &settings,
+                        int scalerFlags) {
+    typedef atg_dtv::Encoder::Error Error;
+
+    ost->scalerFlags = scalerFlags;
+
+    // Prime the cache for the nominal input size
+    SwsContext *context = ost->conversionCache.getContext(
+            settings.inputWidth, settings.inputHeight,
+            inputPixelFormat(settings), ost->codecContext->width,
+            ost->codecContext->height, ost->codecContext->pix_fmt, scalerFlags);
+
+    if (context == nullptr) { return Error::CouldNotCreateConversionContext; }
+
+    return Error::None;
+}
+
 atg_dtv::Encoder::Error
 openVideoStream(AVFormatContext *, const AVCodec *codec,
                 atg_dtv::OutputStream *ost,
-                atg_dtv::Encoder::VideoSettings &settings) {
+                atg_dtv::Encoder::VideoSettings &settings, int scalerFlags) {
     typedef atg_dtv::Encoder::Error Error;
 
     if (avcodec_open2(ost->codecContext, codec, nullptr) < 0) {
@@ -384,180 +929,998 @@ openVideoStream(AVFormatContext *, const AVCodec *codec,
 
     if (ost->frame == nullptr) { return Error::CouldNotAllocateFrame; }
 
-    ost->tempFrame = allocateVideoFrame(
-            (settings.inputAlpha)
-                    ? (settings.bgr ? AV_PIX_FMT_BGRA : AV_PIX_FMT_RGBA)
-                    : (settings.bgr ? AV_PIX_FMT_BGR24 : AV_PIX_FMT_RGB24),
-            settings.inputWidth, settings.inputHeight);
-
-    if (ost->tempFrame == nullptr) { return Error::CouldNotAllocateFrame; }
-
     if (avcodec_parameters_from_context(ost->av_stream->codecpar,
                                         ost->codecContext) < 0) {
         return Error::CouldNotCopyStreamParameters;
     }
 
-    ost->swsContext = sws_getContext(
-            settings.inputWidth, settings.inputHeight,
-            (settings.inputAlpha)
-                    ? (settings.bgr ? AV_PIX_FMT_BGRA : AV_PIX_FMT_RGBA)
-                    : (settings.bgr ? AV_PIX_FMT_BGR24 : AV_PIX_FMT_RGB24),
-            ost->codecContext->width, ost->codecContext->height,
-            ost->codecContext->pix_fmt, SWS_BICUBIC, nullptr, nullptr, nullptr);
+    ost->conversionCache.initialize(settings.conversionCacheSize);
+    return createConversionContext(ost, settings, scalerFlags);
+}
+
+atg_dtv::Encoder::Error
+convertPixels(const atg_dtv::Frame *src, int y, int rows,
+              uint8_t *const dstData[4], const int dstLinesize[4],
+              AVPixelFormat dstFormat, int dstWidth, int dstHeight,
+              atg_dtv::ConversionCache *cache, int flags,
+              AVPixelFormat srcFormat) {
+    typedef atg_dtv::Encoder::Error Error;
 
-    if (ost->swsContext == nullptr) {
-        return Error::CouldNotCreateConversionContext;
+    // Convert straight from the producer's memory; swscale handles arbitrary
+    // and negative strides, so flipped or padded input needs no extra copy
+    int srcStride = 0;
+    const uint8_t *srcData = src->getPixels(&srcStride);
+
+    // With externalBuffers, a frame submitted without setExternalBuffer()
+    // has no pixels at all
+    if (srcData == nullptr) { return Error::MissingFrameBuffer; }
+    srcData += ptrdiff_t(y) * srcStride;
+
+    // Each frame is scaled from its own size to the fixed output size
+    SwsContext *context =
+            cache->getContext(src->m_width, rows, srcFormat, dstWidth,
+                              dstHeight, dstFormat, flags);
+    if (context == nullptr) { return Error::CouldNotCreateConversionContext; }
+
+    int chromaShiftX = 0, chromaShiftY = 0;
+    av_pix_fmt_get_chroma_sub_sample(dstFormat, &chromaShiftX, &chromaShiftY);
+
+    uint8_t *dst[4];
+    for (int i = 0; i < 4; ++i) {
+        const int dstRow = (i == 1 || i == 2) ? (y >> chromaShiftY) : y;
+        dst[i] = (dstData[i] != nullptr)
+                         ? dstData[i] + ptrdiff_t(dstRow) * dstLinesize[i]
+                         : nullptr;
     }
 
+    DTV_TRACE_SCOPE("sws_scale");
+
+    const uint8_t *const srcSlice[] = {srcData};
+    const int srcStrides[] = {srcStride};
+    sws_scale(context, srcSlice, srcStrides, 0, rows, dst, dstLinesize);
+
     return Error::None;
 }
 
-void copyVideoData(atg_dtv::Frame *src, AVFrame *,
-                   atg_dtv::Encoder::VideoSettings &settings,
-                   atg_dtv::OutputStream *ost) {
-    const int pixelSize =
-            settings.inputAlpha ? (4 * sizeof(uint8_t)) : (3 * sizeof(uint8_t));
-    memcpy(ost->tempFrame->data[0], src->m_rgb,
-           size_t(src->m_width * src->m_height * pixelSize));
+void setVideoFrameProperties(const atg_dtv::Frame *src,
+                             atg_dtv::OutputStream *ost) {
+    ost->frame->pts = ost->nextPts++;
 
-    if (ost->swsContext != nullptr) {
-        sws_scale(ost->swsContext,
-                  (const uint8_t *const *) ost->tempFrame->data,
-                  ost->tempFrame->linesize, 0, settings.inputHeight,
-                  ost->frame->data, ost->frame->linesize);
+    // The frame is reused, so the request has to be cleared as well as set
+    ost->frame->pict_type =
+            src->m_keyframe ? AV_PICTURE_TYPE_I : AV_PICTURE_TYPE_NONE;
+#if defined(AV_FRAME_FLAG_KEY)
+    if (src->m_keyframe) {
+        ost->frame->flags |= AV_FRAME_FLAG_KEY;
+    } else {
+        ost->frame->flags &= ~AV_FRAME_FLAG_KEY;
     }
+#else
+    ost->frame->key_frame = src->m_keyframe ? 1 : 0;
+#endif
+}
 
-    ost->frame->pts = ost->nextPts++;
+atg_dtv::Encoder::Error copyVideoData(atg_dtv::Frame *src, AVFrame *,
+                                      atg_dtv::Encoder::VideoSettings &settings,
+                                      atg_dtv::OutputStream *ost) {
+    typedef atg_dtv::Encoder::Error Error;
+
+    DTV_TRACE_SCOPE("copyVideoData");
+
+    // The encoder may still hold a reference to the previous frame
+    if (av_frame_make_writable(ost->frame) < 0) {
+        src->releaseExternalBuffer();
+        return Error::CouldNotAllocateFrame;
+    }
+
+    const Error err = convertPixels(
+            src, 0, src->m_height, ost->frame->data, ost->frame->linesize,
+            ost->codecContext->pix_fmt, ost->codecContext->width,
+            ost->codecContext->height, &ost->conversionCache, ost->scalerFlags,
+            inputPixelFormat(settings));
+
+    src->releaseExternalBuffer();
+    if (err != Error::None) { return err; }
+
+    setVideoFrameProperties(src, ost);
+
+    return Error::None;
 }
 
-atg_dtv::Encoder::Error writeVideoFrame(AVFormatContext *oc,
-                                        AVCodecContext *codecContext,
-                                        AVStream *av_stream, AVFrame *frame,
-                                        AVPacket *packet) {
+atg_dtv::Encoder::Error copyConvertedData(atg_dtv::Frame *src,
+                                          atg_dtv::OutputStream *ost) {
     typedef atg_dtv::Encoder::Error Error;
 
-    if (avcodec_send_frame(codecContext, frame) < 0) {
-        return Error::CouldNotSendFrameToEncoder;
+    DTV_TRACE_SCOPE("copyConvertedData");
+
+    if (av_frame_make_writable(ost->frame) < 0) {
+        return Error::CouldNotAllocateFrame;
     }
 
-    while (true) {
-        const int r = avcodec_receive_packet(codecContext, packet);
-        if (r == AVERROR(EAGAIN) || r == AVERROR_EOF) {
-            break;
-        } else if (r < 0) {
-            return Error::CouldNotEncodeFrame;
+    const AVPixelFormat format = ost->codecContext->pix_fmt;
+    const int width = ost->codecContext->width;
+    const int height = ost->codecContext->height;
+
+    uint8_t *data[4];
+    int linesize[4];
+    if (av_image_fill_arrays(data, linesize, src->m_converted, format, width,
+                             height, atg_dtv::Frame::ConvertedAlignment) < 0) {
+        return Error::CouldNotAllocateFrame;
+    }
+
+    av_image_copy(ost->frame->data, ost->frame->linesize,
+                  const_cast<const uint8_t **>(data), linesize, format, width,
+                  height);
+
+    setVideoFrameProperties(src, ost);
+
+    return Error::None;
+}
+
+atg_dtv::Encoder::Error
+reopenVideoCodec(AVFormatContext *oc, const AVCodec *codec,
+                 atg_dtv::OutputStream *ost,
+                 atg_dtv::Encoder::VideoSettings &settings, int speedLevel,
+                 atg_dtv::KeyframeIndex *index,
+                 atg_dtv::LatencyStats *latency) {
+    typedef atg_dtv::Encoder::Error Error;
+
+    // Drain the current encoder so that the new one starts on a clean
+    // keyframe
+    const Error err = flush(oc, ost, index, latency);
+    if (err != Error::None) { return err; }
+
+    const AVCodecID codecId = ost->codecContext->codec_id;
+    avcodec_free_context(&ost->codecContext);
+
+    ost->codecContext = avcodec_alloc_context3(codec);
+    if (ost->codecContext == nullptr) {
+        return Error::CouldNotAllocateEncodingContext;
+    }
+
+    setEncoderPreset(ost->codecContext, codec, settings, speedLevel);
+    setKeyframeOptions(ost->codecContext, codec);
+    if (settings.lowLatency) { setLowLatencyOptions(ost->codecContext, codec); }
+    configureVideoContext(ost->codecContext, codecId, codec, settings);
+
+    if (avcodec_open2(ost->codecContext, codec, nullptr) < 0) {
+        return Error::CouldNotOpenVideoCodec;
+    }
+
+    return Error::None;
+}
+
+atg_dtv::Encoder::Error atg_dtv::Encoder::convertFrame(Frame *src,
+                                                       Frame *dst) {
+    DTV_TRACE_SCOPE("convertFrame");
+
+    uint8_t *data[4];
+    int linesize[4];
+    if (av_image_fill_arrays(data, linesize, dst->m_converted,
+                             AVPixelFormat(m_convertedFormat),
+                             m_videoSettings.width, m_videoSettings.height,
+                             atg_dtv::Frame::ConvertedAlignment) < 0) {
+        return Error::CouldNotAllocateFrame;
+    }
+
+    return convertSlices(src, data, linesize);
+}
+
+atg_dtv::Encoder::Error
+atg_dtv::Encoder::convertSlices(Frame *src, uint8_t *const data[4],
+                                const int linesize[4]) {
+    const AVPixelFormat format = AVPixelFormat(m_convertedFormat);
+    const int width = m_videoSettings.width;
+    const int height = m_videoSettings.height;
+    const int flags = m_conversionFlags;
+
+    if (m_sliceCount == 1 || src->m_height != height) {
+        return convertPixels(src, 0, src->m_height, data, linesize, format,
+                             width, height, &m_sliceCaches[0], flags,
+                             inputPixelFormat(m_videoSettings));
+    }
+
+    // Without vertical scaling every row range converts independently, as long
+    // as slices start on a chroma row
+    int chromaShiftX = 0, chromaShiftY = 0;
+    av_pix_fmt_get_chroma_sub_sample(format, &chromaShiftX, &chromaShiftY);
+    const int rowsPerSlice =
+            FFALIGN((height + m_sliceCount - 1) / m_sliceCount,
+                    1 << chromaShiftY);
+
+    std::vector<Error> results(m_sliceCount, Error::None);
+    for (int i = 0; i < m_sliceCount && i * rowsPerSlice < height; ++i) {
+        const int y = i * rowsPerSlice;
+        const int rows = std::min(rowsPerSlice, height - y);
+        ConversionCache *cache = &m_sliceCaches[i];
+        const AVPixelFormat srcFormat = inputPixelFormat(m_videoSettings);
+        Error *result = &results[i];
+
+        m_conversionPool.submit([=] {
+            *result = convertPixels(src, y, rows, data, linesize, format,
+                                    width, rows, cache, flags, srcFormat);
+        });
+    }
+
+    m_conversionPool.wait();
+
+    for (const Error err : results) {
+        if (err != Error::None) { return err; }
+    }
+
+    return Error::None;
+}
+
+atg_dtv::Encoder::Error atg_dtv::Encoder::convertVideoFrame(Frame *src) {
+    DTV_TRACE_SCOPE("convertVideoFrame");
+
+    // Slices are converted in parallel straight into the codec's frame
+    if (av_frame_make_writable(m_videoStream.frame) < 0) {
+        src->releaseExternalBuffer();
+        return Error::CouldNotAllocateFrame;
+    }
+
+    const Error err = convertSlices(src, m_videoStream.frame->data,
+                                    m_videoStream.frame->linesize);
+    src->releaseExternalBuffer();
+    if (err != Error::None) { return err; }
+
+    setVideoFrameProperties(src, &m_videoStream);
+
+    return Error::None;
+}
+
+void atg_dtv::Encoder::destroyStaging() {
+    m_staging.releaseExternalBuffer();
+
+    delete[] m_staging.m_rgb;
+    m_staging.m_rgb = nullptr;
+    m_staging.m_maxWidth = m_staging.m_maxHeight = 0;
+
+    // Holds a queued frame's audio while a frame is pending
+    delete[] m_staging.m_audio;
+    m_staging.m_audio = nullptr;
+    m_staging.m_audioCapacity = 0;
+
+    m_pendingFrame = nullptr;
+}
+
+atg_dtv::Encoder::Error
+atg_dtv::Encoder::initializeSession(VideoSettings &settings, int bufferSize) {
+    m_videoSettings = settings;
+    m_stopped = false;
+    m_complete = false;
+    m_started = false;
+    m_error = Error::None;
+    m_bufferSize = bufferSize;
+    m_audioChannels = 0;
+    m_framesWritten = 0;
+    m_segmentFrames = 0;
+    m_videoStream.writePts = 0;
+    m_rateControlMode = RateControlMode::Unsupported;
+    m_rateControl.bitRate = settings.bitRate;
+    m_rateControl.maxBitRate = settings.maxBitRate;
+    m_rateControl.vbvBufferSize = settings.vbvBufferSize;
+    m_rateControlPending = false;
+
+    if (settings.intermediate) {
+        // The capture stage stores the input losslessly at its native size;
+        // scaling and the final codec are applied by the transcode
+        m_finalSettings = settings;
+        m_finalSettings.intermediate = false;
+        m_finalSettings.lowPriority = true;
+
+        // The transcode fills its own frames from the intermediate file, so
+        // the options that describe how the producer hands frames over don't
+        // apply to it
+        m_finalSettings.externalBuffers = false;
+        m_finalSettings.convertOnSubmit = false;
+        m_finalSettings.spill = false;
+        m_finalSettings.remote = false;
+        m_finalSettings.checkpoint = false;
+
+        m_videoSettings.fname = intermediateFname(settings);
+        m_videoSettings.width = settings.inputWidth;
+        m_videoSettings.height = settings.inputHeight;
+        m_videoSettings.hardwareEncoding = false;
+        m_videoSettings.adaptiveSpeed = false;
+
+        // Only the final output is indexed
+        m_videoSettings.keyframeIndex = false;
+    }
+
+    Error err = Error::None;
+    if (m_videoSettings.remote &&
+        (!SharedRing::isSupported() || m_scheduler != nullptr ||
+         settings.externalBuffers || settings.convertOnSubmit ||
+         settings.spill)) {
+        err = Error::RemoteNotSupported;
+    }
+
+    if (m_videoSettings.checkpoint) {
+        if (!m_resume) {
+            m_checkpoint.initialize(m_videoSettings.fname,
+                                    settings.checkpointFname.empty()
+                                            ? m_videoSettings.fname +
+                                                      ".checkpoint"
+                                            : settings.checkpointFname,
+                                    settings.frameRate);
+        } else if (m_checkpoint.getFname() != m_videoSettings.fname ||
+                   m_checkpoint.getFrameRate() != settings.frameRate) {
+            err = Error::CheckpointMismatch;
         }
 
-        av_packet_rescale_ts(packet, codecContext->time_base,
-                             av_stream->time_base);
-        packet->stream_index = av_stream->index;
+        // Producer-side counters continue from the last durable segment
+        m_framesWritten = m_checkpoint.getFrames();
+        m_videoStream.writePts = m_checkpoint.getFrames();
+    }
 
-        if (av_interleaved_write_frame(oc, packet) < 0) {
-            return Error::CouldNotWriteOutputPacket;
+    if (!m_resume || !m_videoSettings.checkpoint) { m_resumeFrame = 0; }
+    m_resume = false;
+
+    // Everything the producer needs is worked out here without opening the
+    // output, which is left to startup()
+    AVPixelFormat pixelFormat = AV_PIX_FMT_NONE;
+    if (err == Error::None) {
+        err = resolveOutputFormats(m_videoSettings, &pixelFormat,
+                                   &m_audioSampleRate, &m_audioChannels);
+    }
+
+    const int pixelSize = m_videoSettings.inputAlpha ? 4 : 3;
+    m_lineWidth = m_videoSettings.externalBuffers
+                          ? 0
+                          : FFALIGN(m_videoSettings.inputWidth * pixelSize, 64);
+
+    m_convertedFormat = pixelFormat;
+    if (err == Error::None && (m_videoSettings.convertOnSubmit ||
+                               m_videoSettings.lowLatency)) {
+        m_convertedSize = size_t(av_image_get_buffer_size(
+                pixelFormat, m_videoSettings.width, m_videoSettings.height,
+                atg_dtv::Frame::ConvertedAlignment));
+
+        // Replaced with the encoder's scaler quality once it is open
+        m_conversionFlags = SWS_BICUBIC;
+
+        // Each slice needs its own contexts since they run concurrently
+        m_sliceCount = std::max(1, settings.conversionThreads);
+        if (m_videoSettings.lowLatency && m_sliceCount == 1) {
+            m_sliceCount = std::max(
+                    1, std::min(4, int(std::thread::hardware_concurrency())));
+        }
+
+        m_sliceCaches = new ConversionCache[m_sliceCount];
+        for (int i = 0; i < m_sliceCount; ++i) {
+            m_sliceCaches[i].initialize(settings.conversionCacheSize);
+        }
+
+        if (m_sliceCount > 1) { m_conversionPool.initialize(m_sliceCount); }
+    }
+
+    int capacity = bufferSize;
+    if (err == Error::None && settings.bufferBytes > 0) {
+        const size_t frameSize =
+                m_videoSettings.convertOnSubmit
+                        ? m_convertedSize
+                        : size_t(m_lineWidth) *
+                                  size_t(m_videoSettings.inputHeight);
+        if (frameSize > 0) {
+            capacity = int(std::min(settings.bufferBytes / frameSize,
+                                    size_t(INT_MAX)));
+            capacity = std::max(capacity, 2);
+        }
+    }
+
+    // The producer waits for each frame to be taken before starting the next
+    if (m_videoSettings.lowLatency) { capacity = 1; }
+
+    if (m_serving) {
+        // Frames are read in place from the producer's process
+        m_queue.initializeShared(&m_ring, false);
+        m_queue.holdFrames(m_videoSettings.checkpoint);
+    } else if (err == Error::None && m_videoSettings.remote) {
+        err = createSharedQueue(settings, capacity);
+    } else {
+        m_queue.initialize(capacity);
+    }
+
+    m_latency.initialize(LatencyWindow);
+
+    if (err == Error::None && m_videoSettings.spill &&
+        !m_queue.enableSpill(settings.spillFname.empty()
+                                     ? m_videoSettings.fname + ".spill"
+                                     : settings.spillFname,
+                             settings.spillCompression, pixelSize,
+                             settings.spillLimit)) {
+        err = Error::CouldNotOpenSpillFile;
+    }
+
+    return err;
+}
+
+atg_dtv::Encoder::Error atg_dtv::Encoder::startup() {
+    DTV_TRACE_SCOPE("startup");
+
+    if (m_videoSettings.checkpoint && !m_checkpoint.save()) {
+        return Error::CouldNotWriteCheckpoint;
+    }
+
+    if (m_videoSettings.adaptiveSpeed) {
+        m_governor.initialize(m_videoSettings.speedGovernor,
+                              1.0 / m_videoSettings.frameRate);
+    }
+
+    m_segmentPresetLevel = -1;
+
+    Error err = setup(getOutputFname());
+    if (err != Error::None) { return err; }
+
+    // Checkpoint segments are indexed when they are joined instead
+    if (m_videoSettings.keyframeIndex && !m_videoSettings.checkpoint) {
+        const AVRational timeBase = m_videoStream.av_stream->time_base;
+        if (!m_keyframeIndex.open(getKeyframeIndexFname(), timeBase.num,
+                                  timeBase.den)) {
+            return Error::CouldNotWriteKeyframeIndex;
+        }
+    }
+
+    m_conversionFlags = m_videoStream.scalerFlags;
+
+    // A lossless capture has no bitrate to change, and reopening needs the
+    // codec parameters to be carried in-band
+    if (m_videoSettings.intermediate) {
+        m_rateControlMode = RateControlMode::Unsupported;
+    } else if (supportsLiveRateControl(m_videoCodec,
+                                       m_videoStream.codecContext)) {
+        m_rateControlMode = (strcmp(m_videoCodec->name, "libx264") == 0)
+                                    ? RateControlMode::LiveVbv
+                                    : RateControlMode::Live;
+    } else if ((m_fmt->flags & AVFMT_GLOBALHEADER) == 0) {
+        m_rateControlMode = RateControlMode::Reopen;
+    } else {
+        m_rateControlMode = RateControlMode::Unsupported;
+    }
+
+    if (m_videoSettings.audio) {
+        m_audioFifo = av_audio_fifo_alloc(
+                AV_SAMPLE_FMT_S16, m_audioChannels,
+                audioFrameSize(m_audioStream.codecContext));
+        if (m_audioFifo == nullptr) { return Error::CouldNotAllocateFrame; }
+
+        // Audio that was still buffered when the render stopped was lost;
+        // silence keeps the rest aligned with the resumed frames
+        int64_t gap = m_videoSettings.checkpoint
+                              ? av_rescale(m_checkpoint.getFrames(),
+                                           m_audioSampleRate,
+                                           m_videoSettings.frameRate) -
+                                        m_checkpoint.getAudioSamples()
+                              : 0;
+        std::vector<int16_t> silence(
+                size_t(std::max<int64_t>(std::min<int64_t>(gap, 4096), 0)) *
+                m_audioChannels);
+        while (gap > 0) {
+            const int samples = int(std::min<int64_t>(gap, 4096));
+            void *data = silence.data();
+            if (av_audio_fifo_write(m_audioFifo, &data, samples) < samples) {
+                return Error::CouldNotAllocateFrame;
+            }
+
+            gap -= samples;
         }
     }
 
+    m_started = true;
+
     return Error::None;
 }
 
-void atg_dtv::Encoder::setup() {
+void atg_dtv::Encoder::release() {
+    // Also closes the output of a prepared session that was never started
+    destroy();
+
+    if (m_audioFifo != nullptr) {
+        av_audio_fifo_free(m_audioFifo);
+        m_audioFifo = nullptr;
+    }
+
+    m_queue.destroy();
+    destroyStaging();
+
+    // The encoder process still reports to the producer after stopping
+    if (!m_serving) { m_ring.close(); }
+
+    m_conversionPool.destroy();
+    delete[] m_sliceCaches;
+    m_sliceCaches = nullptr;
+    m_sliceCount = 0;
+
+    m_prepared = false;
+    m_started = false;
+}
+
+atg_dtv::Encoder::Error atg_dtv::Encoder::setup(const std::string &fname) {
     Error err = Error::None;
 
-    avformat_alloc_output_context2(&m_oc, nullptr, nullptr,
-                                   m_videoSettings.fname.c_str());
+    avformat_alloc_output_context2(
+            &m_oc, nullptr, m_videoSettings.intermediate ? "matroska" : nullptr,
+            fname.c_str());
 
-    if (m_oc == nullptr) {
-        m_error = Error::CouldNotAllocateOutputContext;
-        return;
-    }
+    if (m_oc == nullptr) { return Error::CouldNotAllocateOutputContext; }
 
     m_fmt = m_oc->oformat;
 
-    if (m_fmt->video_codec != AV_CODEC_ID_NONE) {
-        addStream(&m_videoStream, m_oc, &m_videoCodec, m_fmt->video_codec,
-                  m_videoSettings);
+    // The preset can't be changed later without reopening the codec, so a
+    // slower one than the baseline would stick for the whole session
+    if (m_videoSettings.adaptiveSpeed &&
+        (m_fmt->flags & AVFMT_GLOBALHEADER) != 0) {
+        m_governor.setMinLevel(SpeedGovernor::getBaselineLevel());
+    }
+
+    const int speedLevel =
+            m_videoSettings.adaptiveSpeed ? m_governor.getLevel() : 0;
+    const int scalerFlags =
+            m_videoSettings.adaptiveSpeed
+                    ? SpeedGovernor::getLevelSettings(speedLevel).scalerFlags
+                    : SWS_BICUBIC;
+
+    // Segments are joined by stream copy under the first one's header, so
+    // with global headers they must all be encoded with the same preset
+    int presetLevel = speedLevel;
+    if (m_videoSettings.checkpoint &&
+        (m_fmt->flags & AVFMT_GLOBALHEADER) != 0) {
+        if (m_segmentPresetLevel < 0) { m_segmentPresetLevel = speedLevel; }
+        presetLevel = m_segmentPresetLevel;
+    }
+
+    const AVCodecID videoCodec =
+            m_videoSettings.intermediate
+                    ? intermediateCodecId(m_videoSettings.intermediateCodec)
+                    : m_fmt->video_codec;
+    const AVCodecID audioCodec = m_videoSettings.intermediate
+                                         ? AV_CODEC_ID_PCM_S16LE
+                                         : m_fmt->audio_codec;
+
+    if (videoCodec != AV_CODEC_ID_NONE) {
+        addStream(&m_videoStream, m_oc, &m_videoCodec, videoCodec,
+                  m_videoSettings, presetLevel);
     } else {
-        m_error = Error::NotAVideoFormat;
-        return;
+        return Error::NotAVideoFormat;
     }
 
     if (m_videoSettings.audio) {
-        addStream(&m_audioStream, m_oc, &m_audioCodec, m_fmt->audio_codec,
-                  m_videoSettings);
+        addStream(&m_audioStream, m_oc, &m_audioCodec, audioCodec,
+                  m_videoSettings, 0);
     }
 
-    err = openVideoStream(m_oc, m_videoCodec, &m_videoStream, m_videoSettings);
-    if (err != Error::None) {
-        m_error = err;
-        return;
-    }
+    err = openVideoStream(m_oc, m_videoCodec, &m_videoStream, m_videoSettings,
+                          scalerFlags);
+    if (err != Error::None) { return err; }
 
     if (m_videoSettings.audio) {
-        err = openAudioStream(m_oc, m_audioCodec, &m_audioStream,
-                              m_videoSettings);
-        if (err != Error::None) {
-            m_error = err;
-            return;
-        }
+        err = openAudioStream(m_oc, m_audioCodec, &m_audioStream);
+        if (err != Error::None) { return err; }
+    }
+
+    // The muxer then calls avio_flush() after every packet
+    if (m_videoSettings.lowLatency) {
+        m_oc->flush_packets = 1;
+        m_oc->flags |= AVFMT_FLAG_FLUSH_PACKETS;
     }
 
     if ((m_fmt->flags & AVFMT_NOFILE) == 0) {
-        if (avio_open(&m_oc->pb, m_videoSettings.fname.c_str(),
-                      AVIO_FLAG_WRITE) < 0) {
-            m_error = Error::CouldNotOpenFile;
-            return;
+        if (avio_open(&m_oc->pb, fname.c_str(), AVIO_FLAG_WRITE) < 0) {
+            return Error::CouldNotOpenFile;
         } else {
             m_openedFile = true;
         }
     }
 
     if (avformat_write_header(m_oc, nullptr) < 0) {
-        m_error = Error::CouldNotWriteHeader;
-        return;
+        return Error::CouldNotWriteHeader;
     }
 
-    m_lineWidth = m_videoStream.tempFrame->linesize[0];
+    return Error::None;
 }
 
 void atg_dtv::Encoder::worker() {
+    DTV_TRACE_THREAD_NAME("dtv encoder");
+
+    if (m_videoSettings.lowPriority) {
+        ThreadPool::setCurrentThreadPriority(ThreadPool::Priority::Low);
+    }
+
+    // A prepared session was opened by prepare()
     Error err = Error::None;
-    while (true) {
-        Frame *frame = m_queue.waitFrame();
-        if (frame != nullptr) {
-            copyVideoData(frame, m_videoStream.frame, m_videoSettings,
-                          &m_videoStream);
-            err = writeVideoFrame(m_oc, m_videoStream.codecContext,
-                                  m_videoStream.av_stream, m_videoStream.frame,
-                                  m_videoStream.tempPacket);
-
-            for (int audioSamples = 0; audioSamples < frame->m_audioSamples;) {
-                audioSamples += copyAudioData(frame, m_videoSettings,
-                                              &m_audioStream, audioSamples);
-                err = writeAudioFrame(m_oc, &m_audioStream);
-            }
+    if (!m_started) {
+        err = startup();
+        m_promise.set_value(err);
+    }
 
-            m_queue.popFrame();
+    while (err == Error::None) {
+        Frame *frame;
+        {
+            DTV_TRACE_SCOPE("waitFrame");
+            frame = m_queue.waitFrame();
+        }
 
-            if (err != Error::None) { goto end; }
+        if (frame != nullptr) {
+            err = encodeFrame(frame);
         } else {
             std::lock_guard<std::mutex> lk(m_lock);
             if (m_stopped) { break; }
         }
     }
 
-    flush(m_oc, &m_videoStream);
-    flush(m_oc, &m_audioStream);
+    complete(err);
+}
+
+bool atg_dtv::Encoder::step(int maxFrames, int *frames) {
+    DTV_TRACE_SCOPE("step");
+
+    if (!m_started) {
+        const Error err = startup();
+        m_promise.set_value(err);
+        if (err != Error::None) {
+            *frames = 0;
+            complete(err);
+            return true;
+        }
+    }
+
+    for (*frames = 0; *frames < maxFrames; ++(*frames)) {
+        Frame *frame = m_queue.peekFrame();
+        if (frame == nullptr) { break; }
+
+        const Error err = encodeFrame(frame);
+        if (err != Error::None) {
+            complete(err);
+            return true;
+        }
+    }
+
+    if (*frames < maxFrames) {
+        bool stopped;
+        {
+            std::lock_guard<std::mutex> lk(m_lock);
+            stopped = m_stopped;
+        }
+
+        // Nothing is submitted after commit(), so an empty queue is final
+        if (stopped && m_queue.getLength() == 0) {
+            complete(Error::None);
+            return true;
+        }
+    }
+
+    return false;
+}
+
+atg_dtv::Encoder::Error atg_dtv::Encoder::encodeFrame(Frame *frame) {
+    Error err = Error::None;
+
+    const auto start = std::chrono::steady_clock::now();
+    const int queueLength = m_queue.getLength();
+
+    if (m_videoSettings.adaptiveSpeed && m_videoStream.nextPts > 0 &&
+        m_videoStream.nextPts %
+                        m_videoSettings.speedGovernor.evaluationInterval ==
+                0) {
+        err = adjustSpeed();
+        if (err != Error::None) { return err; }
+    }
+
+    if (m_rateControlPending) {
+        err = applyRateControl(frame);
+        if (err != Error::None) { return err; }
+    }
+
+    const int64_t pts = m_videoStream.nextPts;
+    if (m_videoSettings.convertOnSubmit) {
+        err = copyConvertedData(frame, &m_videoStream);
+    } else if (m_videoSettings.lowLatency) {
+        err = convertVideoFrame(frame);
+    } else {
+        err = copyVideoData(frame, m_videoStream.frame, m_videoSettings,
+                            &m_videoStream);
+    }
+
+    if (err == Error::None) {
+        m_latency.begin(pts, frame->m_submitTime);
+        err = writeFrame(m_oc, &m_videoStream, m_videoStream.frame,
+                         &m_keyframeIndex, &m_latency);
+    }
+
+    if (err == Error::None && m_audioFifo != nullptr &&
+        frame->m_audioSamples > 0) {
+        void *audio = frame->m_audio;
+        if (av_audio_fifo_write(m_audioFifo, &audio, frame->m_audioSamples) <
+            frame->m_audioSamples) {
+            err = Error::CouldNotEncodeFrame;
+        } else {
+            err = encodeAudio(false);
+        }
+    }
+
+    m_queue.popFrame();
+
+    if (err != Error::None) { return err; }
+
+    ++m_framesWritten;
+    ++m_segmentFrames;
+
+    if (m_videoSettings.adaptiveSpeed) {
+        m_governor.recordFrame(queueLength, m_queue.getCapacity(),
+                               std::chrono::duration<double>(
+                                       std::chrono::steady_clock::now() - start)
+                                       .count());
+    }
+
+    if (m_videoSettings.checkpoint &&
+        m_segmentFrames >= m_videoSettings.checkpointInterval) {
+        // Buffered audio carries over into the next segment
+        err = closeSegment(m_segmentFrames, false);
+        if (err == Error::None) { err = setup(getOutputFname()); }
+        if (err != Error::None) { return err; }
+
+        m_segmentFrames = 0;
+    }
+
+    return Error::None;
+}
+
+atg_dtv::Encoder::Error
+atg_dtv::Encoder::applyRateControl(const Frame *frame) {
+    AVCodecContext *codecContext = m_videoStream.codecContext;
+
+    // Reopening starts a new GOP, so wait for one that was due anyway
+    if (m_rateControlMode == RateControlMode::Reopen && !frame->m_keyframe &&
+        m_videoStream.nextPts % std::max(codecContext->gop_size, 1) != 0) {
+        return Error::None;
+    }
+
+    RateControl rateControl;
+    {
+        std::lock_guard<std::mutex> lk(m_lock);
+        rateControl = m_rateControl;
+        m_rateControlPending = false;
+    }
+
+    // Kept in the settings so that new segments and reopened codecs use it
+    m_videoSettings.bitRate = rateControl.bitRate;
+    m_videoSettings.maxBitRate = rateControl.maxBitRate;
+    m_videoSettings.vbvBufferSize = rateControl.vbvBufferSize;
+
+    DTV_TRACE_SCOPE("applyRateControl");
+    if (m_rateControlMode == RateControlMode::Live ||
+        m_rateControlMode == RateControlMode::LiveVbv) {
+        codecContext->bit_rate = rateControl.bitRate;
+        codecContext->rc_max_rate = rateControl.maxBitRate;
+        codecContext->rc_buffer_size = rateControl.vbvBufferSize;
+        return Error::None;
+    }
+
+    const int speedLevel =
+            m_videoSettings.adaptiveSpeed ? m_governor.getLevel() : 0;
+    return reopenVideoCodec(m_oc, m_videoCodec, &m_videoStream,
+                            m_videoSettings, speedLevel, &m_keyframeIndex,
+                            &m_latency);
+}
+
+atg_dtv::Encoder::Error atg_dtv::Encoder::encodeAudio(bool drain) {
+    AVFrame *chunk = m_audioStream.tempFrame;
+    const int frameSize = audioFrameSize(m_audioStream.codecContext);
+    const int capabilities = m_audioStream.codecContext->codec->capabilities;
+    const bool variableSize =
+            (capabilities & AV_CODEC_CAP_VARIABLE_FRAME_SIZE) != 0;
+
+    while (true) {
+        const int available = av_audio_fifo_size(m_audioFifo);
+        const int samples = std::min(available, frameSize);
+        if (samples == 0 || (samples < frameSize && !drain && !variableSize)) {
+            break;
+        }
+
+        chunk->nb_samples = frameSize;
+        void **data = reinterpret_cast<void **>(chunk->data);
+        if (av_audio_fifo_read(m_audioFifo, data, samples) < samples) {
+            return Error::CouldNotEncodeFrame;
+        }
+
+        // Only the last frame may be short, and only if the codec allows it
+        chunk->nb_samples = samples;
+        if (samples < frameSize && !variableSize &&
+            (capabilities & AV_CODEC_CAP_SMALL_LAST_FRAME) == 0) {
+            av_samples_set_silence(chunk->data, samples, frameSize - samples,
+                                   m_audioChannels, AV_SAMPLE_FMT_S16);
+            chunk->nb_samples = frameSize;
+        }
+
+        const Error err = writeAudioFrame(m_oc, &m_audioStream);
+        if (err != Error::None) { return err; }
+    }
+
+    return Error::None;
+}
+
+void atg_dtv::Encoder::complete(Error err) {
+    if (err == Error::None) {
+        err = m_videoSettings.checkpoint ? finishCheckpoint(m_segmentFrames)
+                                         : finishOutput(true);
+    }
 
-    av_write_trailer(m_oc);
+    // The output is still finished, but frames were lost
+    if (err == Error::None && m_queue.hasSpillError()) {
+        err = Error::CouldNotSpillFrame;
+    }
 
-end:
     std::lock_guard<std::mutex> lk(m_lock);
-    m_error = err;
+    if (err != Error::None) { m_error = err; }
     m_stopped = true;
 
     m_queue.stop();
 
     destroy();
+
+    if (m_audioFifo != nullptr) {
+        av_audio_fifo_free(m_audioFifo);
+        m_audioFifo = nullptr;
+    }
+
+    // An empty checkpointed session leaves no intermediate file behind
+    if (m_videoSettings.intermediate && m_error == Error::None &&
+        (m_framesWritten > 0 || !m_videoSettings.checkpoint)) {
+        startTranscode(m_framesWritten);
+    }
+
+    m_complete = true;
+    m_completeCv.notify_all();
+}
+
+void atg_dtv::Encoder::startTranscode(int64_t totalFrames) {
+    m_transcoder = new Transcoder;
+    m_transcoder->initialize(m_videoSettings.fname, m_finalSettings,
+                             m_bufferSize, totalFrames, m_transcodeCallback);
+
+    ThreadPool *pool = (m_finalSettings.transcodePool != nullptr)
+                               ? m_finalSettings.transcodePool
+                               : sharedTranscodePool();
+
+    Transcoder *transcoder = m_transcoder;
+    pool->submit([transcoder] { transcoder->run(); });
+}
+
+atg_dtv::Encoder::Error atg_dtv::Encoder::adjustSpeed() {
+    const int previousLevel = m_governor.getLevel();
+    const int level = m_governor.evaluate();
+    if (level == previousLevel) { return Error::None; }
+
+    const SpeedGovernor::Level &previous =
+            SpeedGovernor::getLevelSettings(previousLevel);
+    const SpeedGovernor::Level &next = SpeedGovernor::getLevelSettings(level);
+
+    SpeedGovernor::Adjustment adjustment;
+    adjustment.frameIndex = m_videoStream.nextPts;
+    adjustment.previousLevel = previousLevel;
+    adjustment.level = level;
+    adjustment.queueOccupancy = m_governor.getQueueOccupancy();
+    adjustment.encodeTime = m_governor.getEncodeTime();
+    adjustment.targetFrameTime = m_governor.getTargetFrameTime();
+    adjustment.encoderPreset = encoderPreset(m_videoCodec, next);
+    adjustment.encoderPresetChanged = false;
+    adjustment.scalerFlags = next.scalerFlags;
+    adjustment.scalerChanged = false;
+
+    // Switching presets requires a fresh encoder, which is only possible when
+    // codec parameters are carried in-band rather than in the container header
+    const char *previousPreset = encoderPreset(m_videoCodec, previous);
+    if (adjustment.encoderPreset != nullptr &&
+        strcmp(adjustment.encoderPreset, previousPreset) != 0 &&
+        (m_fmt->flags & AVFMT_GLOBALHEADER) == 0) {
+        const Error err =
+                reopenVideoCodec(m_oc, m_videoCodec, &m_videoStream,
+                                 m_videoSettings, level, &m_keyframeIndex,
+                                 &m_latency);
+        if (err != Error::None) { return err; }
+
+        adjustment.encoderPresetChanged = true;
+    }
+
+    if (next.scalerFlags != previous.scalerFlags) {
+        const Error err = createConversionContext(
+                &m_videoStream, m_videoSettings, next.scalerFlags);
+        if (err != Error::None) { return err; }
+
+        m_conversionFlags = next.scalerFlags;
+        adjustment.scalerChanged = true;
+    }
+
+    SpeedGovernor::Callback callback;
+    {
+        std::lock_guard<std::mutex> lk(m_lock);
+        callback = m_speedCallback;
+    }
+
+    if (callback) { callback(adjustment); }
+
+    return Error::None;
+}
+
+std::string atg_dtv::Encoder::getKeyframeIndexFname() const {
+    return m_videoSettings.keyframeIndexFname.empty()
+                   ? m_videoSettings.fname + ".keyframes"
+                   : m_videoSettings.keyframeIndexFname;
+}
+
+std::string atg_dtv::Encoder::getOutputFname() const {
+    if (!m_videoSettings.checkpoint) { return m_videoSettings.fname; }
+    return m_checkpoint.getSegmentFname(m_checkpoint.getSegmentCount());
+}
+
+atg_dtv::Encoder::Error atg_dtv::Encoder::finishOutput(bool drainAudio) {
+    Error err = Error::None;
+    if (drainAudio && m_audioFifo != nullptr) { err = encodeAudio(true); }
+
+    if (err == Error::None) {
+        err = flush(m_oc, &m_videoStream, &m_keyframeIndex, &m_latency);
+    }
+
+    if (err == Error::None) { err = flush(m_oc, &m_audioStream); }
+    if (err == Error::None && av_write_trailer(m_oc) < 0) {
+        err = Error::CouldNotWriteOutputPacket;
+    }
+
+    if (!m_keyframeIndex.close() && err == Error::None) {
+        err = Error::CouldNotWriteKeyframeIndex;
+    }
+
+    return err;
+}
+
+atg_dtv::Encoder::Error atg_dtv::Encoder::closeSegment(int64_t frames,
+                                                       bool final) {
+    DTV_TRACE_SCOPE("closeSegment");
+
+    // Segments record the audio actually encoded into them, which is what
+    // the next one is offset by when they are joined
+    const Error err = finishOutput(final);
+    const int64_t audioSamples = m_audioStream.audioSamples;
+    destroy();
+
+    if (err != Error::None) { return err; }
+
+    // The segment only counts once the manifest naming it has been replaced
+    m_checkpoint.addSegment(frames, audioSamples);
+    if (!m_checkpoint.save()) { return Error::CouldNotWriteCheckpoint; }
+
+    // The producer may now reuse the slots of the segment's frames
+    if (m_serving) {
+        m_queue.releaseFrames(m_checkpoint.getFrames() -
+                              m_ring.getFrameOffset());
+    }
+
+    return Error::None;
+}
+
+atg_dtv::Encoder::Error
+atg_dtv::Encoder::finishCheckpoint(int64_t frames) {
+    if (frames > 0) {
+        const Error err = closeSegment(frames, true);
+        if (err != Error::None) { return err; }
+    } else {
+        // Nothing was written since the last rotation
+        destroy();
+        remove(getOutputFname().c_str());
+    }
+
+    const char *formatName =
+            m_videoSettings.intermediate ? "matroska" : nullptr;
+    if (!m_checkpoint.concatenate(formatName,
+                                  m_videoSettings.keyframeIndex
+                                          ? getKeyframeIndexFname()
+                                          : "")) {
+        return Error::CouldNotConcatenateSegments;
+    }
+
+    return Error::None;
 }
 
 void atg_dtv::Encoder::destroy() {
@@ -566,4 +1929,9 @@ void atg_dtv::Encoder::destroy() {
 
     if (m_openedFile) { avio_closep(&m_oc->pb); }
     if (m_oc != nullptr) { avformat_free_context(m_oc); }
+
+    m_oc = nullptr;
+    m_openedFile = false;
+
+    m_keyframeIndex.close();
 }
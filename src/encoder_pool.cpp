@@ -0,0 +1,222 @@
+#include "../include/dtv/encoder_pool.h"
+
+#include "../include/dtv/ffmpeg.h"
+
+#include <algorithm>
+
+size_t estimateFrameSize(const atg_dtv::Encoder::VideoSettings &settings) {
+    const size_t pixelSize = settings.inputAlpha ? 4 : 3;
+    if (settings.convertOnSubmit) {
+        // Intermediate captures keep an RGB-like format at the input size
+        return settings.intermediate
+                       ? size_t(settings.inputWidth) * settings.inputHeight *
+                                 pixelSize
+                       : size_t(settings.width) * settings.height * 3 / 2;
+    } else if (settings.externalBuffers) {
+        return 0;
+    } else {
+        return size_t(FFALIGN(settings.inputWidth * int(pixelSize), 64)) *
+               settings.inputHeight;
+    }
+}
+
+atg_dtv::EncoderPool::EncoderPool() {
+    m_memoryUsed = 0;
+    m_progress = 0.0;
+}
+
+atg_dtv::EncoderPool::~EncoderPool() { destroy(); }
+
+void atg_dtv::EncoderPool::initialize(const Settings &settings) {
+    m_settings = settings;
+    m_settings.framesPerStep = std::max(1, settings.framesPerStep);
+    m_memoryUsed = 0;
+    m_progress = 0.0;
+
+    const int threads =
+            (settings.threads > 0)
+                    ? settings.threads
+                    : std::max(1, int(std::thread::hardware_concurrency()));
+    m_threads.initialize(threads);
+}
+
+void atg_dtv::EncoderPool::destroy() {
+    // Sessions only end once their encoders are committed; anything still
+    // queued is drained here
+    m_threads.destroy();
+
+    std::lock_guard<std::mutex> lk(m_lock);
+    for (Session *session : m_sessions) {
+        // Nothing is left to step the encoder, so it is finished here and
+        // its stop() no longer waits on the pool
+        Encoder *encoder = session->encoder;
+        if (!encoder->m_started) {
+            encoder->m_promise.set_value(Encoder::Error::PoolDestroyed);
+        }
+
+        encoder->complete(Encoder::Error::PoolDestroyed);
+        encoder->m_scheduler = nullptr;
+
+        m_memoryUsed -= session->memory;
+        delete session;
+    }
+
+    m_sessions.clear();
+}
+
+atg_dtv::Encoder::Error
+atg_dtv::EncoderPool::run(Encoder *encoder, Encoder::VideoSettings &settings,
+                          int bufferSize, Priority priority) {
+    typedef Encoder::Error Error;
+
+    {
+        std::lock_guard<std::mutex> lk(m_lock);
+        if (findSession(encoder) != nullptr) { return Error::AlreadyRunning; }
+    }
+
+    const size_t frameSize = estimateFrameSize(settings);
+    size_t memory = 0;
+    if (m_settings.memoryBudget > 0 && frameSize > 0) {
+        std::lock_guard<std::mutex> lk(m_lock);
+
+        const size_t budget = m_settings.memoryBudget;
+        const size_t available =
+                (budget > m_memoryUsed) ? budget - m_memoryUsed : 0;
+        const size_t requested = (settings.bufferBytes > 0)
+                                         ? settings.bufferBytes
+                                         : size_t(bufferSize) * frameSize;
+        memory = std::min(requested, available);
+        if (memory < 2 * frameSize) { return Error::MemoryBudgetExceeded; }
+
+        m_memoryUsed += memory;
+    }
+
+    Encoder::VideoSettings sessionSettings = settings;
+    if (memory > 0) { sessionSettings.bufferBytes = memory; }
+    if (sessionSettings.codecThreads == 0) {
+        sessionSettings.codecThreads = m_settings.codecThreads;
+    }
+
+    encoder->m_scheduler = this;
+    encoder->run(sessionSettings, bufferSize);
+
+    {
+        std::lock_guard<std::mutex> lk(m_lock);
+
+        const Error err = encoder->getError();
+        if (err != Error::None) {
+            m_memoryUsed -= memory;
+            return err;
+        }
+
+        // New sessions start level with the others rather than far behind
+        m_sessions.push_back(new Session{encoder, priority, memory, m_progress,
+                                         false, false});
+    }
+
+    // The first step opens the output
+    notify(encoder);
+
+    return Error::None;
+}
+
+void atg_dtv::EncoderPool::setPriority(Encoder *encoder, Priority priority) {
+    std::lock_guard<std::mutex> lk(m_lock);
+
+    Session *session = findSession(encoder);
+    if (session != nullptr) { session->priority = priority; }
+}
+
+size_t atg_dtv::EncoderPool::getMemoryUsed() {
+    std::lock_guard<std::mutex> lk(m_lock);
+    return m_memoryUsed;
+}
+
+int atg_dtv::EncoderPool::getSessionCount() {
+    std::lock_guard<std::mutex> lk(m_lock);
+    return (int) m_sessions.size();
+}
+
+void atg_dtv::EncoderPool::notify(Encoder *encoder) {
+    {
+        std::lock_guard<std::mutex> lk(m_lock);
+
+        Session *session = findSession(encoder);
+        if (session == nullptr || session->pending) { return; }
+
+        session->pending = true;
+
+        // A running session is resubmitted when its step ends
+        if (session->running) { return; }
+    }
+
+    m_threads.submit([this] { schedule(); });
+}
+
+void atg_dtv::EncoderPool::schedule() {
+    // There is one task per pending session, but each task serves whichever
+    // pending session is furthest behind
+    Session *session = nullptr;
+    {
+        std::lock_guard<std::mutex> lk(m_lock);
+        for (Session *candidate : m_sessions) {
+            if (!candidate->pending || candidate->running) { continue; }
+            if (session == nullptr || candidate->progress < session->progress) {
+                session = candidate;
+            }
+        }
+
+        if (session == nullptr) { return; }
+
+        session->pending = false;
+        session->running = true;
+        m_progress = session->progress;
+    }
+
+    int frames = 0;
+    const bool finished =
+            session->encoder->step(m_settings.framesPerStep, &frames);
+
+    bool resubmit = false;
+    {
+        std::lock_guard<std::mutex> lk(m_lock);
+
+        session->running = false;
+        session->progress +=
+                std::max(frames, 1) / getWeight(session->priority);
+
+        if (finished) {
+            m_memoryUsed -= session->memory;
+            m_sessions.erase(
+                    std::find(m_sessions.begin(), m_sessions.end(), session));
+            delete session;
+        } else {
+            // A full step means more frames are probably waiting
+            if (frames == m_settings.framesPerStep) { session->pending = true; }
+            resubmit = session->pending;
+        }
+    }
+
+    if (resubmit) { m_threads.submit([this] { schedule(); }); }
+}
+
+atg_dtv::EncoderPool::Session *
+atg_dtv::EncoderPool::findSession(Encoder *encoder) {
+    for (Session *session : m_sessions) {
+        if (session->encoder == encoder) { return session; }
+    }
+
+    return nullptr;
+}
+
+double atg_dtv::EncoderPool::getWeight(Priority priority) {
+    switch (priority) {
+        case Priority::Low:
+            return 1.0;
+        case Priority::High:
+            return 4.0;
+        case Priority::Normal:
+        default:
+            return 2.0;
+    }
+}
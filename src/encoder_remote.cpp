@@ -0,0 +1,357 @@
+#include "../include/dtv/encoder.h"
+
+#include "../include/dtv/trace.h"
+
+#include <algorithm>
+#include <map>
+#include <sstream>
+
+#if defined(__linux__)
+#include <spawn.h>
+#include <sys/types.h>
+#include <sys/wait.h>
+
+extern char **environ;
+#endif
+
+// How often the encoder process checks that the producer is still there, and
+// the supervisor that the encoder process is
+const int ProcessPollInterval = 100;
+
+// Settings travel to the encoder process as "key value" lines
+struct SettingsWriter {
+    std::ostringstream out;
+
+    SettingsWriter() { out.precision(17); }
+
+    template <typename T>
+    void operator()(const char *key, const T &value) {
+        out << key << ' ' << value << '\n';
+    }
+
+    void operator()(const char *key,
+                    const atg_dtv::Encoder::IntermediateCodec &value) {
+        out << key << ' ' << int(value) << '\n';
+    }
+};
+
+struct SettingsReader {
+    std::map<std::string, std::string> values;
+
+    template <typename T>
+    void operator()(const char *key, T &value) {
+        auto it = values.find(key);
+        if (it != values.end()) { std::istringstream(it->second) >> value; }
+    }
+
+    void operator()(const char *key, std::string &value) {
+        auto it = values.find(key);
+        if (it != values.end()) { value = it->second; }
+    }
+
+    void operator()(const char *key,
+                    atg_dtv::Encoder::IntermediateCodec &value) {
+        int codec = int(value);
+        (*this)(key, codec);
+        value = atg_dtv::Encoder::IntermediateCodec(codec);
+    }
+};
+
+// Options that only make sense in the producer's process are left out
+template <typename Visitor>
+void visitSettings(atg_dtv::Encoder::VideoSettings &settings,
+                   Visitor &visitor) {
+    visitor("fname", settings.fname);
+    visitor("width", settings.width);
+    visitor("height", settings.height);
+    visitor("inputWidth", settings.inputWidth);
+    visitor("inputHeight", settings.inputHeight);
+    visitor("frameRate", settings.frameRate);
+    visitor("bitRate", settings.bitRate);
+    visitor("maxBitRate", settings.maxBitRate);
+    visitor("vbvBufferSize", settings.vbvBufferSize);
+    visitor("audio", settings.audio);
+    visitor("hardwareEncoding", settings.hardwareEncoding);
+    visitor("inputAlpha", settings.inputAlpha);
+    visitor("bgr", settings.bgr);
+    visitor("codecThreads", settings.codecThreads);
+    visitor("keyframeInterval", settings.keyframeInterval);
+    visitor("keyframeIndex", settings.keyframeIndex);
+    visitor("keyframeIndexFname", settings.keyframeIndexFname);
+    visitor("adaptiveSpeed", settings.adaptiveSpeed);
+    visitor("highWatermark", settings.speedGovernor.highWatermark);
+    visitor("lowWatermark", settings.speedGovernor.lowWatermark);
+    visitor("targetFrameTime", settings.speedGovernor.targetFrameTime);
+    visitor("relaxRatio", settings.speedGovernor.relaxRatio);
+    visitor("relaxEvaluations", settings.speedGovernor.relaxEvaluations);
+    visitor("evaluationInterval", settings.speedGovernor.evaluationInterval);
+    visitor("initialLevel", settings.speedGovernor.initialLevel);
+    visitor("intermediate", settings.intermediate);
+    visitor("intermediateCodec", settings.intermediateCodec);
+    visitor("intermediateFname", settings.intermediateFname);
+    visitor("keepIntermediate", settings.keepIntermediate);
+    visitor("lowPriority", settings.lowPriority);
+    visitor("lowLatency", settings.lowLatency);
+    visitor("conversionCacheSize", settings.conversionCacheSize);
+    visitor("conversionThreads", settings.conversionThreads);
+    visitor("bufferBytes", settings.bufferBytes);
+    visitor("checkpoint", settings.checkpoint);
+    visitor("checkpointInterval", settings.checkpointInterval);
+    visitor("checkpointFname", settings.checkpointFname);
+}
+
+std::string serializeSettings(atg_dtv::Encoder::VideoSettings settings,
+                              int bufferSize, const std::string &manifestFname,
+                              bool resume) {
+    SettingsWriter writer;
+    visitSettings(settings, writer);
+    writer("bufferSize", bufferSize);
+    writer("checkpointManifest", manifestFname);
+    writer("resume", resume);
+
+    return writer.out.str();
+}
+
+void parseSettings(const std::string &config,
+                   atg_dtv::Encoder::VideoSettings *settings, int *bufferSize,
+                   std::string *manifestFname, bool *resume) {
+    SettingsReader reader;
+
+    std::istringstream in(config);
+    std::string line;
+    while (std::getline(in, line)) {
+        const size_t separator = line.find(' ');
+        if (separator == std::string::npos) { continue; }
+
+        reader.values[line.substr(0, separator)] = line.substr(separator + 1);
+    }
+
+    visitSettings(*settings, reader);
+    reader("bufferSize", *bufferSize);
+    reader("checkpointManifest", *manifestFname);
+    reader("resume", *resume);
+}
+
+int spawnDaemon(const std::string &path, const std::string &ringName) {
+#if defined(__linux__)
+    char *argv[] = {const_cast<char *>(path.c_str()),
+                    const_cast<char *>(ringName.c_str()), nullptr};
+
+    pid_t pid;
+    if (posix_spawnp(&pid, path.c_str(), nullptr, nullptr, argv, environ) !=
+        0) {
+        return -1;
+    }
+
+    return int(pid);
+#else
+    (void) path;
+    (void) ringName;
+    return -1;
+#endif
+}
+
+bool hasExited(int pid, bool wait) {
+#if defined(__linux__)
+    int status;
+    const pid_t result = waitpid(pid_t(pid), &status, wait ? 0 : WNOHANG);
+
+    // A process that was already reaped has exited too
+    return result != 0;
+#else
+    (void) pid;
+    (void) wait;
+    return true;
+#endif
+}
+
+atg_dtv::Encoder::Error
+atg_dtv::Encoder::createSharedQueue(const VideoSettings &settings,
+                                    int capacity) {
+    SharedRing::Layout layout;
+    layout.capacity = capacity;
+    layout.maxWidth = m_videoSettings.inputWidth;
+    layout.maxHeight = m_videoSettings.inputHeight;
+    layout.lineWidth = m_lineWidth;
+
+    // A frame's span of audio is at most one sample over the average
+    layout.audioCapacity =
+            m_videoSettings.audio
+                    ? (m_audioSampleRate / m_videoSettings.frameRate + 1) *
+                              m_audioChannels
+                    : 0;
+
+    // Slots stay taken until the segment holding their frames is durable, so
+    // one has to fit in the queue with room to spare
+    VideoSettings remoteSettings = settings;
+    remoteSettings.checkpointInterval = std::max(
+            1, std::min(settings.checkpointInterval, capacity / 2));
+
+    const std::string config = serializeSettings(
+            remoteSettings, m_bufferSize,
+            settings.checkpoint ? m_checkpoint.getManifestFname() : "",
+            m_resumeFrame > 0);
+    if (!m_ring.create(SharedRing::uniqueName(), layout, config)) {
+        m_queue.initialize(capacity);
+        return Error::CouldNotMapSharedMemory;
+    }
+
+    // The ring counts frames from the first one the producer submits
+    m_ring.setFrameOffset(m_resumeFrame);
+    m_queue.initializeShared(&m_ring, true);
+
+    return Error::None;
+}
+
+void atg_dtv::Encoder::supervise() {
+    DTV_TRACE_THREAD_NAME("dtv supervisor");
+
+    {
+        std::lock_guard<std::mutex> lk(m_lock);
+        m_remoteLatency = LatencyStats::Summary();
+    }
+
+    const uint32_t starting = uint32_t(SharedRing::Status::Starting);
+    const uint32_t complete = uint32_t(SharedRing::Status::Complete);
+
+    Error err = Error::None;
+    bool ready = false;
+
+    int pid = spawnDaemon(m_videoSettings.encoderdPath, m_ring.getName());
+    if (pid < 0) { err = Error::CouldNotStartEncoderDaemon; }
+
+    while (err == Error::None) {
+        const uint32_t status = m_ring.load(SharedRing::Counter::Status);
+        {
+            std::lock_guard<std::mutex> lk(m_lock);
+            m_remoteLatency = m_ring.getLatency();
+        }
+
+        // A failed startup is reported by completing with the error
+        if (!ready && status != starting) {
+            m_promise.set_value((status == complete) ? Error(m_ring.getError())
+                                                     : Error::None);
+            ready = true;
+        }
+
+        // The encoder process may still be transcoding, which the producer
+        // doesn't wait for
+        if (status == complete) {
+            if (!hasExited(pid, false)) {
+                std::thread([pid] { hasExited(pid, true); }).detach();
+            }
+
+            err = Error(m_ring.getError());
+            break;
+        }
+
+        if (!hasExited(pid, false)) {
+            m_ring.wait(SharedRing::Counter::Status, status,
+                        ProcessPollInterval);
+            continue;
+        }
+
+        // It may have completed just before exiting
+        if (m_ring.load(SharedRing::Counter::Status) == complete) { continue; }
+
+        // Without a checkpoint, the frames already encoded are lost with the
+        // unfinished output
+        if (!m_videoSettings.checkpoint ||
+            m_ring.getRestarts() >= m_videoSettings.maxEncoderRestarts) {
+            err = Error::EncoderDaemonCrashed;
+            break;
+        }
+
+        m_ring.addRestart();
+        pid = spawnDaemon(m_videoSettings.encoderdPath, m_ring.getName());
+        if (pid < 0) { err = Error::CouldNotStartEncoderDaemon; }
+    }
+
+    if (!ready) { m_promise.set_value(err); }
+
+    std::lock_guard<std::mutex> lk(m_lock);
+    if (err != Error::None) { m_error = err; }
+    m_stopped = true;
+
+    // Unblocks a producer waiting for space
+    m_queue.stop();
+
+    m_complete = true;
+    m_completeCv.notify_all();
+}
+
+atg_dtv::Encoder::Error atg_dtv::Encoder::serve(const std::string &ringName) {
+    {
+        std::lock_guard<std::mutex> lk(m_lock);
+        if (!m_stopped) { return Error::AlreadyRunning; }
+    }
+
+    if (!SharedRing::isSupported()) { return Error::RemoteNotSupported; }
+    if (!m_ring.attach(ringName)) { return Error::CouldNotMapSharedMemory; }
+
+    VideoSettings settings;
+    int bufferSize = 0;
+    std::string manifestFname;
+    bool resumeRequested = false;
+    parseSettings(m_ring.getConfig(), &settings, &bufferSize, &manifestFname,
+                  &resumeRequested);
+
+    // A restarted encoder carries on from the last durable segment; the
+    // producer still holds every frame after it
+    Error err = Error::None;
+    if (settings.checkpoint &&
+        (resumeRequested || m_ring.getRestarts() > 0)) {
+        if (resume(manifestFname)) {
+            m_ring.store(SharedRing::Counter::Released,
+                         uint32_t(m_checkpoint.getFrames() -
+                                  m_ring.getFrameOffset()));
+        } else if (resumeRequested) {
+            err = Error::CheckpointMismatch;
+        }
+    }
+
+    m_serving = true;
+    if (err == Error::None) { err = run(settings, bufferSize).get(); }
+
+    if (err == Error::None) {
+        m_ring.store(SharedRing::Counter::Status,
+                     uint32_t(SharedRing::Status::Running));
+        m_ring.wake(SharedRing::Counter::Status);
+    }
+
+    // The stream ends when the producer commits or goes away
+    bool orphaned = false;
+    while (err == Error::None && running() &&
+           m_ring.load(SharedRing::Counter::Committed) == 0) {
+        if (!m_ring.isCreatorAlive()) {
+            orphaned = true;
+            break;
+        }
+
+        m_ring.setLatency(m_latency.getSummary());
+        m_ring.wait(SharedRing::Counter::Committed, 0, ProcessPollInterval);
+    }
+
+    commit();
+    stop();
+    if (err == Error::None) { err = getError(); }
+
+    // The producer is released as soon as the capture is finished rather
+    // than after the transcode
+    m_ring.setLatency(m_latency.getSummary());
+    m_ring.setError(int(err));
+    m_ring.store(SharedRing::Counter::Status,
+                 uint32_t(SharedRing::Status::Complete));
+    m_ring.wake(SharedRing::Counter::Status);
+
+    // Nobody else is left to remove the segment
+    if (orphaned) { m_ring.unlink(); }
+
+    m_serving = false;
+    m_ring.close();
+
+    waitTranscode();
+    if (err == Error::None) { err = getError(); }
+
+    return err;
+}
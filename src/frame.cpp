@@ -1,6 +1,31 @@
 #include "../include/dtv/frame.h"
 
 #include <assert.h>
+#include <cstddef>
+#include <cstdlib>
+#include <cstring>
+
+#if defined(_WIN32)
+#include <malloc.h>
+#endif
+
+uint8_t *allocateAligned(size_t size, size_t alignment) {
+#if defined(_WIN32)
+    return static_cast<uint8_t *>(_aligned_malloc(size, alignment));
+#else
+    void *data = nullptr;
+    if (posix_memalign(&data, alignment, size) != 0) { return nullptr; }
+    return static_cast<uint8_t *>(data);
+#endif
+}
+
+void freeAligned(uint8_t *data) {
+#if defined(_WIN32)
+    _aligned_free(data);
+#else
+    free(data);
+#endif
+}
 
 atg_dtv::Frame::Frame() {
     m_rgb = nullptr;
@@ -8,6 +33,14 @@ atg_dtv::Frame::Frame() {
     m_maxHeight = 0;
     m_maxWidth = 0;
     m_lineWidth = 0;
+    m_flip = false;
+    m_keyframe = false;
+
+    m_external = nullptr;
+    m_externalStride = 0;
+
+    m_converted = nullptr;
+    m_convertedCapacity = 0;
 
     m_audio = nullptr;
     m_audioCapacity = 0;
@@ -17,4 +50,95 @@ atg_dtv::Frame::Frame() {
 atg_dtv::Frame::~Frame() {
     assert(m_rgb == nullptr);
     assert(m_audio == nullptr);
+    assert(m_converted == nullptr);
+    assert(m_external == nullptr);
+}
+
+void atg_dtv::Frame::setExternalBuffer(const uint8_t *data, int stride,
+                                       bool flip,
+                                       const ReleaseCallback &release) {
+    m_external = data;
+    m_externalStride = stride;
+    m_flip = flip;
+    m_release = release;
+}
+
+void atg_dtv::Frame::releaseExternalBuffer() {
+    if (m_external == nullptr) { return; }
+
+    m_external = nullptr;
+    m_externalStride = 0;
+
+    ReleaseCallback release;
+    release.swap(m_release);
+    if (release) { release(); }
+}
+
+const uint8_t *atg_dtv::Frame::getPixels(int *stride) const {
+    const uint8_t *data = (m_external != nullptr) ? m_external : m_rgb;
+    *stride = (m_external != nullptr) ? m_externalStride : m_lineWidth;
+
+    if (m_flip) {
+        data += ptrdiff_t(m_height - 1) * (*stride);
+        *stride = -(*stride);
+    }
+
+    return data;
+}
+
+void atg_dtv::Frame::allocate(int width, int height, int lineWidth,
+                              int audioSamples, int audioChannels,
+                              size_t convertedSize) {
+    if (m_maxHeight < height || m_maxWidth < width) {
+        delete[] m_rgb;
+        m_rgb = nullptr;
+    }
+
+    // Frames backed by external buffers don't need pixel storage of their own
+    if (m_rgb == nullptr && lineWidth > 0) {
+        m_rgb = new uint8_t[size_t(height) * size_t(lineWidth)];
+        m_maxWidth = width;
+        m_maxHeight = height;
+        m_lineWidth = lineWidth;
+    }
+
+    if (m_convertedCapacity < convertedSize) {
+        freeAligned(m_converted);
+        m_converted = allocateAligned(convertedSize, ConvertedAlignment);
+        m_convertedCapacity = convertedSize;
+    }
+
+    const int totalAudioSamples = audioSamples * audioChannels;
+    if (totalAudioSamples > m_audioCapacity) {
+        delete[] m_audio;
+        m_audio = nullptr;
+    }
+
+    if (m_audio == nullptr && totalAudioSamples != 0) {
+        m_audio = new int16_t[size_t(totalAudioSamples)];
+        m_audioCapacity = totalAudioSamples;
+        memset(m_audio, 0, sizeof(int16_t) * size_t(totalAudioSamples));
+    }
+
+    m_audioSamples = audioSamples;
+    m_width = width;
+    m_height = height;
+    m_flip = false;
+    m_keyframe = false;
+}
+
+void atg_dtv::Frame::destroy() {
+    releaseExternalBuffer();
+
+    delete[] m_rgb;
+    m_rgb = nullptr;
+    m_maxWidth = m_maxHeight = 0;
+
+    delete[] m_audio;
+    m_audio = nullptr;
+    m_audioCapacity = 0;
+
+    freeAligned(m_converted);
+    m_converted = nullptr;
+    m_convertedCapacity = 0;
 }
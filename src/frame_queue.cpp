@@ -1,13 +1,33 @@
 #include "../include/dtv/frame_queue.h"
 
+#include <algorithm>
 #include <assert.h>
+#include <cstring>
+
+// Wakes are explicit; the timeout only bounds how long a wait can outlive a
+// peer process that went away without one
+const int SharedWaitTimeout = 100;
 
 atg_dtv::FrameQueue::FrameQueue() {
     m_frames = nullptr;
     m_capacity = 0;
     m_length = 0;
     m_readIndex = 0;
+    m_released = nullptr;
+    m_acquired = 0;
     m_stopped = false;
+
+    m_spillPending = false;
+    m_spilled = 0;
+    m_spillBytes = 0;
+    m_spillLimit = 0;
+    m_audioChannels = 0;
+    m_spillError = false;
+    m_spillResync = false;
+
+    m_ring = nullptr;
+    m_producer = false;
+    m_holdFrames = false;
 }
 
 atg_dtv::FrameQueue::~FrameQueue() { assert(m_frames == nullptr); }
@@ -18,89 +38,194 @@ void atg_dtv::FrameQueue::initialize(int size) {
     m_capacity = size;
     m_length = 0;
     m_readIndex = 0;
+    m_acquired = 0;
     m_stopped = false;
 
     m_frames = new Frame[m_capacity];
+    m_released = new bool[m_capacity];
+    for (int i = 0; i < m_capacity; ++i) { m_released[i] = false; }
+
+    m_spillPending = false;
+    m_spilled = 0;
+    m_spillBytes = 0;
+    m_spillError = false;
+    m_spillResync = false;
+
+    m_ring = nullptr;
+    m_producer = false;
+    m_holdFrames = false;
+}
+
+void atg_dtv::FrameQueue::initializeShared(SharedRing *ring, bool producer) {
+    const SharedRing::Layout &layout = ring->getLayout();
+    initialize(layout.capacity);
+
+    m_ring = ring;
+    m_producer = producer;
+
+    for (int i = 0; i < m_capacity; ++i) {
+        Frame &f = m_frames[i];
+        f.m_rgb = ring->getPixels(i);
+        f.m_maxWidth = layout.maxWidth;
+        f.m_maxHeight = layout.maxHeight;
+        f.m_lineWidth = layout.lineWidth;
+        f.m_audio = ring->getAudio(i);
+        f.m_audioCapacity = layout.audioCapacity;
+    }
+
+    if (!producer) {
+        ring->store(SharedRing::Counter::Read,
+                    ring->load(SharedRing::Counter::Released));
+    }
+}
+
+bool atg_dtv::FrameQueue::enableSpill(const std::string &fname, bool compress,
+                                      int pixelSize, size_t spillLimit) {
+    std::lock_guard<std::mutex> lk(m_lock);
+
+    m_spillLimit = spillLimit;
+    return m_spill.open(fname, compress, pixelSize);
 }
 
 void atg_dtv::FrameQueue::destroy() {
     if (m_frames == nullptr) { return; }
 
-    for (int i = 0; i < m_capacity; ++i) {
-        delete[] m_frames[i].m_rgb;
+    // Slot memory belongs to the ring
+    for (int i = 0; m_ring != nullptr && i < m_capacity; ++i) {
         m_frames[i].m_rgb = nullptr;
-
-        delete[] m_frames[i].m_audio;
+        m_frames[i].m_maxWidth = m_frames[i].m_maxHeight = 0;
         m_frames[i].m_audio = nullptr;
+        m_frames[i].m_audioCapacity = 0;
     }
 
+    for (int i = 0; i < m_capacity; ++i) { m_frames[i].destroy(); }
+
+    m_spill.close();
+    m_spillFrame.destroy();
+    m_spillPending = false;
+    m_spilled = 0;
+    m_spillBytes = 0;
+
     delete[] m_frames;
     m_frames = nullptr;
 
+    delete[] m_released;
+    m_released = nullptr;
+
     m_capacity = 0;
     m_length = 0;
     m_readIndex = 0;
+    m_acquired = 0;
+    m_ring = nullptr;
 }
 
 atg_dtv::Frame *atg_dtv::FrameQueue::newFrame(int width, int height,
                                               int lineWidth, int audioSamples,
-                                              int audioChannels, bool wait) {
-    std::unique_lock<std::mutex> lk(m_lock);
-
-    if (wait) {
-        m_cv.wait(lk, [this] { return m_length < m_capacity || m_stopped; });
+                                              int audioChannels, bool wait,
+                                              size_t convertedSize) {
+    if (m_ring != nullptr) {
+        return newSharedFrame(width, height, audioSamples, audioChannels,
+                              wait);
     }
 
-    if (m_length == m_capacity) { return nullptr; }
-
-    Frame &f = m_frames[(m_readIndex + m_length) % m_capacity];
-    if (f.m_maxHeight < height || f.m_maxWidth < width) {
-        delete[] f.m_rgb;
-        f.m_rgb = nullptr;
-    }
+    std::unique_lock<std::mutex> lk(m_lock);
 
-    if (f.m_rgb == nullptr) {
-        f.m_rgb = new uint8_t[size_t(height) * size_t(lineWidth)];
-        f.m_maxWidth = width;
-        f.m_maxHeight = height;
-        f.m_lineWidth = lineWidth;
-    }
+    // Once anything is spilled, later frames follow it to keep the order
+    auto spillable = [this] {
+        return m_spill.isOpen() &&
+               (m_spillLimit == 0 || m_spillBytes < m_spillLimit);
+    };
+    auto ringFree = [this] { return m_spilled == 0 && m_length < m_capacity; };
 
-    const int totalAudioSamples = audioSamples * audioChannels;
-    if (totalAudioSamples > f.m_audioCapacity) {
-        if (f.m_audio != nullptr) { delete[] f.m_audio; }
+    if (wait) {
+        m_cv.wait(lk, [&] { return ringFree() || spillable() || m_stopped; });
     }
 
-    if (f.m_audio == nullptr && totalAudioSamples != 0) {
-        f.m_audio = new int16_t[size_t(totalAudioSamples)];
-        f.m_audioCapacity = totalAudioSamples;
-        memset(f.m_audio, 0, sizeof(int16_t) * size_t(totalAudioSamples));
-    }
+    const bool spill = !ringFree() && spillable();
+    if (!spill && !ringFree()) { return nullptr; }
 
-    f.m_audioSamples = audioSamples;
-    f.m_width = width;
-    f.m_height = height;
+    Frame &f = spill ? m_spillFrame
+                     : m_frames[(m_readIndex + m_length) % m_capacity];
+    m_spillPending = spill;
+    m_audioChannels = audioChannels;
 
     lk.unlock();
 
+    f.allocate(width, height, lineWidth, audioSamples, audioChannels,
+               convertedSize);
+
     return &f;
 }
 
-void atg_dtv::FrameQueue::submitFrame() {
+bool atg_dtv::FrameQueue::submitFrame() {
+    if (m_ring != nullptr) {
+        submitSharedFrame();
+        return true;
+    }
+
     std::unique_lock<std::mutex> lk(m_lock);
 
-    ++m_length;
+    if (!m_spillPending) {
+        ++m_length;
+
+        lk.unlock();
+        m_cv.notify_one();
+        return true;
+    }
+
+    lk.unlock();
+
+    // The record holds a copy, so external pixels can go back right away
+    const size_t bytes = m_spill.write(m_spillFrame, m_audioChannels);
+    m_spillFrame.releaseExternalBuffer();
+
+    // Still pending while writing so that the file is not rewound under it
+    lk.lock();
+    m_spillPending = false;
+    if (bytes > 0) {
+        // The reader gave up on what came before this record
+        if (m_spillResync) { m_spill.skipToLastRecord(); }
+
+        ++m_spilled;
+        m_spillBytes += bytes;
+    } else {
+        m_spillError = true;
+
+        if (m_spillResync) {
+            m_spill.rewind();
+            m_spillBytes = 0;
+        }
+    }
+
+    m_spillResync = false;
 
     lk.unlock();
     m_cv.notify_one();
+
+    return bytes > 0;
 }
 
 atg_dtv::Frame *atg_dtv::FrameQueue::waitFrame() {
+    if (m_ring != nullptr) {
+        // Only the consumer advances the read counter
+        const uint32_t read = m_ring->load(SharedRing::Counter::Read);
+        for (;;) {
+            const uint32_t written = m_ring->load(SharedRing::Counter::Written);
+            if (written != read) { return loadSharedFrame(read); }
+            if (isStopped()) { return nullptr; }
+
+            m_ring->wait(SharedRing::Counter::Written, written,
+                         SharedWaitTimeout);
+        }
+    }
+
     std::unique_lock<std::mutex> lk(m_lock);
     m_cv.wait(lk, [this] {
-        return this->m_length > 0 || (m_stopped && this->m_length == 0);
+        return this->m_length > 0 || m_spilled > 0 ||
+               (m_stopped && this->m_length == 0);
     });
 
+    loadSpilled(lk);
     if (this->m_length == 0) { return nullptr; }
 
     Frame &f = m_frames[m_readIndex];
@@ -109,7 +234,33 @@ atg_dtv::Frame *atg_dtv::FrameQueue::waitFrame() {
     return &f;
 }
 
+atg_dtv::Frame *atg_dtv::FrameQueue::peekFrame() {
+    if (m_ring != nullptr) {
+        const uint32_t read = m_ring->load(SharedRing::Counter::Read);
+        return (m_ring->load(SharedRing::Counter::Written) != read)
+                       ? loadSharedFrame(read)
+                       : nullptr;
+    }
+
+    std::unique_lock<std::mutex> lk(m_lock);
+
+    loadSpilled(lk);
+    return (m_length > 0) ? &m_frames[m_readIndex] : nullptr;
+}
+
 void atg_dtv::FrameQueue::popFrame() {
+    if (m_ring != nullptr) {
+        const uint32_t read = m_ring->load(SharedRing::Counter::Read) + 1;
+        m_ring->store(SharedRing::Counter::Read, read);
+
+        if (!m_holdFrames) {
+            m_ring->store(SharedRing::Counter::Released, read);
+            m_ring->wake(SharedRing::Counter::Released);
+        }
+
+        return;
+    }
+
     std::unique_lock<std::mutex> lk(m_lock);
 
     assert(m_length > 0);
@@ -121,6 +272,52 @@ void atg_dtv::FrameQueue::popFrame() {
     m_cv.notify_one();
 }
 
+void atg_dtv::FrameQueue::holdFrames(bool hold) { m_holdFrames = hold; }
+
+void atg_dtv::FrameQueue::releaseFrames(int64_t frames) {
+    if (m_ring == nullptr) { return; }
+
+    m_ring->store(SharedRing::Counter::Released, uint32_t(frames));
+    m_ring->wake(SharedRing::Counter::Released);
+}
+
+atg_dtv::Frame *atg_dtv::FrameQueue::acquireFrame() {
+    assert(m_ring == nullptr);
+
+    std::unique_lock<std::mutex> lk(m_lock);
+    m_cv.wait(lk, [this] {
+        return this->m_length > m_acquired ||
+               (m_stopped && this->m_length == m_acquired);
+    });
+
+    if (this->m_length == m_acquired) { return nullptr; }
+
+    Frame &f = m_frames[(m_readIndex + m_acquired) % m_capacity];
+    ++m_acquired;
+
+    lk.unlock();
+    return &f;
+}
+
+void atg_dtv::FrameQueue::releaseFrame(Frame *frame) {
+    std::unique_lock<std::mutex> lk(m_lock);
+
+    const int index = int(frame - m_frames);
+    assert(index >= 0 && index < m_capacity);
+
+    m_released[index] = true;
+    while (m_acquired > 0 && m_released[m_readIndex]) {
+        m_released[m_readIndex] = false;
+
+        --m_acquired;
+        --m_length;
+        m_readIndex = (m_readIndex + 1) % m_capacity;
+    }
+
+    lk.unlock();
+    m_cv.notify_all();
+}
+
 void atg_dtv::FrameQueue::stop() {
     std::unique_lock<std::mutex> lk(m_lock);
 
@@ -128,4 +325,143 @@ void atg_dtv::FrameQueue::stop() {
 
     lk.unlock();
     m_cv.notify_all();
+
+    if (m_ring == nullptr) { return; }
+
+    // The producer's stop is the end of the stream for the consumer too
+    if (m_producer) {
+        m_ring->store(SharedRing::Counter::Committed, 1);
+        m_ring->wake(SharedRing::Counter::Committed);
+        m_ring->wake(SharedRing::Counter::Released);
+    } else {
+        m_ring->wake(SharedRing::Counter::Written);
+    }
+}
+
+int atg_dtv::FrameQueue::getLength() {
+    if (m_ring != nullptr) {
+        // The producer still counts frames that are held after being read
+        const SharedRing::Counter tail = m_producer
+                                                 ? SharedRing::Counter::Released
+                                                 : SharedRing::Counter::Read;
+        return int(m_ring->load(SharedRing::Counter::Written) -
+                   m_ring->load(tail));
+    }
+
+    std::lock_guard<std::mutex> lk(m_lock);
+    return m_length + m_spilled;
+}
+
+bool atg_dtv::FrameQueue::hasSpillError() {
+    std::lock_guard<std::mutex> lk(m_lock);
+    return m_spillError;
+}
+
+void atg_dtv::FrameQueue::loadSpilled(std::unique_lock<std::mutex> &lk) {
+    // Only the consumer loads, into free slots the producer cannot be using
+    // while anything is spilled
+    const int spilled = m_spilled;
+    while (m_spilled > 0 && m_length < m_capacity) {
+        Frame &f = m_frames[(m_readIndex + m_length) % m_capacity];
+
+        lk.unlock();
+        const size_t bytes = m_spill.read(&f);
+        lk.lock();
+
+        if (bytes == 0) {
+            // The rest of the file cannot be trusted
+            m_spillError = true;
+            m_spilled = 0;
+            m_spillBytes = 0;
+
+            // A record still being written can't be found from here; the
+            // producer points the reader at it once it is done
+            m_spillResync = m_spillPending;
+        } else {
+            --m_spilled;
+            m_spillBytes -= std::min(bytes, m_spillBytes);
+            ++m_length;
+        }
+
+        // Reuse the file from the start once it has been drained
+        if (m_spilled == 0 && !m_spillPending) {
+            m_spill.rewind();
+            m_spillBytes = 0;
+        }
+    }
+
+    // A producer may be waiting for the spill to drain
+    if (m_spilled != spilled) { m_cv.notify_all(); }
+}
+
+atg_dtv::Frame *atg_dtv::FrameQueue::newSharedFrame(int width, int height,
+                                                    int audioSamples,
+                                                    int audioChannels,
+                                                    bool wait) {
+    const SharedRing::Layout &layout = m_ring->getLayout();
+    if (width > layout.maxWidth || height > layout.maxHeight ||
+        audioSamples * audioChannels > layout.audioCapacity) {
+        return nullptr;
+    }
+
+    // Only the producer advances the write counter
+    const uint32_t written = m_ring->load(SharedRing::Counter::Written);
+    for (;;) {
+        if (isStopped()) { return nullptr; }
+
+        const uint32_t released =
+                m_ring->load(SharedRing::Counter::Released);
+        if (written - released < uint32_t(m_capacity)) { break; }
+        if (!wait) { return nullptr; }
+
+        m_ring->wait(SharedRing::Counter::Released, released,
+                     SharedWaitTimeout);
+    }
+
+    Frame &f = m_frames[written % uint32_t(m_capacity)];
+    f.allocate(width, height, layout.lineWidth, audioSamples, audioChannels,
+               0);
+
+    return &f;
+}
+
+void atg_dtv::FrameQueue::submitSharedFrame() {
+    const uint32_t written = m_ring->load(SharedRing::Counter::Written);
+    const int index = int(written % uint32_t(m_capacity));
+    const Frame &f = m_frames[index];
+
+    SharedRing::Slot *slot = m_ring->getSlot(index);
+    slot->width = f.m_width;
+    slot->height = f.m_height;
+    slot->flip = f.m_flip ? 1 : 0;
+    slot->keyframe = f.m_keyframe ? 1 : 0;
+    slot->audioSamples = f.m_audioSamples;
+    slot->reserved = 0;
+    slot->submitTime = f.m_submitTime.time_since_epoch().count();
+
+    m_ring->store(SharedRing::Counter::Written, written + 1);
+    m_ring->wake(SharedRing::Counter::Written);
+}
+
+atg_dtv::Frame *atg_dtv::FrameQueue::loadSharedFrame(uint32_t index) {
+    const int slotIndex = int(index % uint32_t(m_capacity));
+    const SharedRing::Slot *slot = m_ring->getSlot(slotIndex);
+
+    Frame &f = m_frames[slotIndex];
+    f.m_width = slot->width;
+    f.m_height = slot->height;
+    f.m_flip = slot->flip != 0;
+    f.m_keyframe = slot->keyframe != 0;
+    f.m_audioSamples = slot->audioSamples;
+
+    // Both processes read the same monotonic clock
+    f.m_submitTime = std::chrono::steady_clock::time_point(
+            std::chrono::steady_clock::duration(slot->submitTime));
+
+    return &f;
+}
+
+bool atg_dtv::FrameQueue::isStopped() {
+    std::lock_guard<std::mutex> lk(m_lock);
+    return m_stopped;
 }
@@ -0,0 +1,291 @@
+#include "../include/dtv/image_sequence_writer.h"
+
+#include "../include/dtv/ffmpeg.h"
+#include "../include/dtv/trace.h"
+
+#include <algorithm>
+#include <climits>
+#include <cstdio>
+
+AVCodecID
+imageCodecId(atg_dtv::ImageSequenceWriter::ImageFormat format) {
+    switch (format) {
+        case atg_dtv::ImageSequenceWriter::ImageFormat::Tiff:
+            return AV_CODEC_ID_TIFF;
+        case atg_dtv::ImageSequenceWriter::ImageFormat::Exr:
+            return AV_CODEC_ID_EXR;
+        case atg_dtv::ImageSequenceWriter::ImageFormat::Png:
+        default:
+            return AV_CODEC_ID_PNG;
+    }
+}
+
+AVPixelFormat imageInputPixelFormat(
+        const atg_dtv::ImageSequenceWriter::Settings &settings) {
+    return (settings.inputAlpha)
+                   ? (settings.bgr ? AV_PIX_FMT_BGRA : AV_PIX_FMT_RGBA)
+                   : (settings.bgr ? AV_PIX_FMT_BGR24 : AV_PIX_FMT_RGB24);
+}
+
+void freeImageEncoderContext(atg_dtv::ImageEncoderContext *context) {
+    if (context->codecContext != nullptr) {
+        avcodec_free_context(&context->codecContext);
+    }
+    if (context->frame != nullptr) { av_frame_free(&context->frame); }
+    if (context->packet != nullptr) { av_packet_free(&context->packet); }
+    if (context->swsContext != nullptr) {
+        sws_freeContext(context->swsContext);
+        context->swsContext = nullptr;
+    }
+}
+
+atg_dtv::Encoder::Error openImageEncoderContext(
+        atg_dtv::ImageEncoderContext *context,
+        const atg_dtv::ImageSequenceWriter::Settings &settings) {
+    typedef atg_dtv::Encoder::Error Error;
+
+    const AVCodec *codec = avcodec_find_encoder(imageCodecId(settings.format));
+    if (codec == nullptr) { return Error::CouldNotFindEncoder; }
+
+    context->codecContext = avcodec_alloc_context3(codec);
+    if (context->codecContext == nullptr) {
+        return Error::CouldNotAllocateEncodingContext;
+    }
+
+    const AVPixelFormat inputFormat = imageInputPixelFormat(settings);
+
+    AVCodecContext *codecContext = context->codecContext;
+    codecContext->width = settings.width;
+    codecContext->height = settings.height;
+    codecContext->time_base = AVRational{1, 1};
+    codecContext->pix_fmt =
+            (codec->pix_fmts != nullptr)
+                    ? avcodec_find_best_pix_fmt_of_list(codec->pix_fmts,
+                                                        inputFormat,
+                                                        settings.inputAlpha,
+                                                        nullptr)
+                    : inputFormat;
+
+    // Parallelism comes from encoding several images at once
+    codecContext->thread_count = 1;
+
+    if (avcodec_open2(codecContext, codec, nullptr) < 0) {
+        return Error::CouldNotOpenVideoCodec;
+    }
+
+    context->frame = av_frame_alloc();
+    if (context->frame == nullptr) { return Error::CouldNotAllocateFrame; }
+
+    context->frame->format = codecContext->pix_fmt;
+    context->frame->width = codecContext->width;
+    context->frame->height = codecContext->height;
+    if (av_frame_get_buffer(context->frame, 0) < 0) {
+        return Error::CouldNotAllocateFrame;
+    }
+
+    context->packet = av_packet_alloc();
+    if (context->packet == nullptr) { return Error::CouldNotAllocatePacket; }
+
+    context->swsContext = sws_getContext(
+            settings.inputWidth, settings.inputHeight, inputFormat,
+            codecContext->width, codecContext->height, codecContext->pix_fmt,
+            SWS_BICUBIC, nullptr, nullptr, nullptr);
+    if (context->swsContext == nullptr) {
+        return Error::CouldNotCreateConversionContext;
+    }
+
+    return Error::None;
+}
+
+atg_dtv::ImageSequenceWriter::ImageSequenceWriter() {
+    m_stopped = true;
+    m_error = Error::None;
+    m_nextIndex = 0;
+    m_lineWidth = 0;
+}
+
+atg_dtv::ImageSequenceWriter::~ImageSequenceWriter() { destroy(); }
+
+void atg_dtv::ImageSequenceWriter::run(Settings &settings, int bufferSize) {
+    std::lock_guard<std::mutex> lk(m_lock);
+    if (!m_stopped) { return; }
+
+    m_settings = settings;
+    m_stopped = false;
+    m_error = Error::None;
+    m_nextIndex = settings.firstIndex;
+
+    const int pixelSize = settings.inputAlpha ? 4 : 3;
+    m_lineWidth = settings.externalBuffers
+                          ? 0
+                          : FFALIGN(settings.inputWidth * pixelSize, 64);
+
+    m_queue.initialize(bufferSize);
+
+    const int threads =
+            (settings.threads > 0)
+                    ? settings.threads
+                    : std::max(1, int(std::thread::hardware_concurrency()));
+    m_pool.initialize(threads);
+}
+
+void atg_dtv::ImageSequenceWriter::commit() {
+    {
+        std::lock_guard<std::mutex> lk(m_lock);
+        m_stopped = true;
+    }
+
+    m_queue.stop();
+}
+
+void atg_dtv::ImageSequenceWriter::stop() {
+    m_pool.wait();
+    m_pool.destroy();
+
+    destroy();
+    m_queue.destroy();
+}
+
+atg_dtv::Frame *atg_dtv::ImageSequenceWriter::newFrame(bool wait) {
+    return m_queue.newFrame(m_settings.inputWidth, m_settings.inputHeight,
+                            m_lineWidth, 0, 0, wait);
+}
+
+void atg_dtv::ImageSequenceWriter::submitFrame() {
+    m_queue.submitFrame();
+
+    Frame *frame = m_queue.acquireFrame();
+    const int64_t index = m_nextIndex++;
+    m_pool.submit([this, frame, index] { writeImage(frame, index); });
+}
+
+atg_dtv::ImageSequenceWriter::Error atg_dtv::ImageSequenceWriter::getError() {
+    std::lock_guard<std::mutex> lk(m_lock);
+    return m_error;
+}
+
+void atg_dtv::ImageSequenceWriter::writeImage(Frame *frame, int64_t index) {
+    Error err = getError();
+    if (err == Error::None) {
+        ImageEncoderContext *context = acquireContext(&err);
+        if (context != nullptr) {
+            err = encodeImage(context, frame, index);
+            releaseContext(context);
+        }
+    }
+
+    // Slots are recycled in order regardless of which image finishes first
+    frame->releaseExternalBuffer();
+    m_queue.releaseFrame(frame);
+
+    if (err != Error::None) {
+        std::lock_guard<std::mutex> lk(m_lock);
+        if (m_error == Error::None) { m_error = err; }
+    }
+}
+
+atg_dtv::ImageSequenceWriter::Error
+atg_dtv::ImageSequenceWriter::encodeImage(ImageEncoderContext *context,
+                                          Frame *frame, int64_t index) {
+    DTV_TRACE_SCOPE("encodeImage");
+
+    if (av_frame_make_writable(context->frame) < 0) {
+        return Error::CouldNotAllocateFrame;
+    }
+
+    int stride = 0;
+    const uint8_t *const src[] = {frame->getPixels(&stride)};
+    const int srcStride[] = {stride};
+    if (src[0] == nullptr) { return Error::MissingFrameBuffer; }
+    {
+        DTV_TRACE_SCOPE("sws_scale");
+        sws_scale(context->swsContext, src, srcStride, 0, frame->m_height,
+                  context->frame->data, context->frame->linesize);
+    }
+
+    frame->releaseExternalBuffer();
+
+    // The pattern takes an int
+    if (index > INT_MAX) { return Error::CouldNotOpenFile; }
+
+    std::vector<char> fname(m_settings.fname.size() + 32);
+    snprintf(fname.data(), fname.size(), m_settings.fname.c_str(), int(index));
+
+    FILE *file = fopen(fname.data(), "wb");
+    if (file == nullptr) { return Error::CouldNotOpenFile; }
+
+    context->frame->pts = index;
+    if (avcodec_send_frame(context->codecContext, context->frame) < 0) {
+        fclose(file);
+        remove(fname.data());
+        return Error::CouldNotSendFrameToEncoder;
+    }
+
+    Error err = Error::None;
+    while (true) {
+        const int r = avcodec_receive_packet(context->codecContext,
+                                             context->packet);
+        if (r == AVERROR(EAGAIN) || r == AVERROR_EOF) {
+            break;
+        } else if (r < 0) {
+            err = Error::CouldNotEncodeFrame;
+            break;
+        }
+
+        const size_t size = size_t(context->packet->size);
+        const size_t written = fwrite(context->packet->data, 1, size, file);
+        av_packet_unref(context->packet);
+
+        if (written != size) {
+            err = Error::CouldNotWriteOutputPacket;
+            break;
+        }
+    }
+
+    if (fclose(file) != 0 && err == Error::None) {
+        err = Error::CouldNotWriteOutputPacket;
+    }
+
+    // A truncated image would pass for a finished one
+    if (err != Error::None) { remove(fname.data()); }
+
+    return err;
+}
+
+atg_dtv::ImageEncoderContext *
+atg_dtv::ImageSequenceWriter::acquireContext(Error *err) {
+    {
+        std::lock_guard<std::mutex> lk(m_lock);
+        if (!m_contexts.empty()) {
+            ImageEncoderContext *context = m_contexts.back();
+            m_contexts.pop_back();
+            return context;
+        }
+    }
+
+    ImageEncoderContext *context = new ImageEncoderContext;
+    *err = openImageEncoderContext(context, m_settings);
+    if (*err != Error::None) {
+        freeImageEncoderContext(context);
+        delete context;
+        return nullptr;
+    }
+
+    return context;
+}
+
+void atg_dtv::ImageSequenceWriter::releaseContext(
+        ImageEncoderContext *context) {
+    std::lock_guard<std::mutex> lk(m_lock);
+    m_contexts.push_back(context);
+}
+
+void atg_dtv::ImageSequenceWriter::destroy() {
+    std::lock_guard<std::mutex> lk(m_lock);
+    for (ImageEncoderContext *context : m_contexts) {
+        freeImageEncoderContext(context);
+        delete context;
+    }
+
+    m_contexts.clear();
+}
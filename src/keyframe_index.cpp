@@ -0,0 +1,39 @@
+#include "../include/dtv/keyframe_index.h"
+
+atg_dtv::KeyframeIndex::KeyframeIndex() {
+    m_file = nullptr;
+    m_count = 0;
+}
+
+atg_dtv::KeyframeIndex::~KeyframeIndex() { close(); }
+
+bool atg_dtv::KeyframeIndex::open(const std::string &fname, int timeBaseNum,
+                                  int timeBaseDen) {
+    close();
+
+    m_file = fopen(fname.c_str(), "w");
+    if (m_file == nullptr) { return false; }
+
+    m_count = 0;
+    fprintf(m_file, "dtv-keyframes 1 time_base %d/%d\n", timeBaseNum,
+            timeBaseDen);
+
+    return true;
+}
+
+void atg_dtv::KeyframeIndex::record(int64_t pts, int64_t offset) {
+    if (m_file == nullptr) { return; }
+
+    fprintf(m_file, "%" PRId64 " %" PRId64 "\n", pts, offset);
+    ++m_count;
+}
+
+bool atg_dtv::KeyframeIndex::close() {
+    if (m_file == nullptr) { return true; }
+
+    const bool written = ferror(m_file) == 0;
+    const bool closed = fclose(m_file) == 0;
+    m_file = nullptr;
+
+    return written && closed;
+}
@@ -0,0 +1,85 @@
+#include "../include/dtv/latency_stats.h"
+
+#include <algorithm>
+
+const size_t MaxInFlight = 256;
+
+double percentile(std::vector<double> &samples, double fraction) {
+    const size_t index = std::min(samples.size() - 1,
+                                  size_t(fraction * samples.size()));
+    std::nth_element(samples.begin(), samples.begin() + index, samples.end());
+    return samples[index];
+}
+
+atg_dtv::LatencyStats::LatencyStats() {
+    m_window = 0;
+    m_next = 0;
+    m_frames = 0;
+}
+
+atg_dtv::LatencyStats::~LatencyStats() {}
+
+void atg_dtv::LatencyStats::initialize(int window) {
+    std::lock_guard<std::mutex> lk(m_lock);
+
+    m_inFlight.clear();
+    m_samples.clear();
+    m_window = std::max(1, window);
+    m_next = 0;
+    m_frames = 0;
+}
+
+void atg_dtv::LatencyStats::begin(int64_t pts, Clock::time_point submitted) {
+    // Timestamps restart with each new output segment
+    if (!m_inFlight.empty() && pts <= m_inFlight.rbegin()->first) {
+        m_inFlight.clear();
+    }
+
+    // Frames that never produced a packet of their own would otherwise pile
+    // up; no codec holds back anywhere near this many
+    if (m_inFlight.size() >= MaxInFlight) {
+        m_inFlight.erase(m_inFlight.begin());
+    }
+
+    m_inFlight[pts] = submitted;
+}
+
+void atg_dtv::LatencyStats::end(int64_t pts) {
+    // Packets come out in decode order, so B-frames arrive after the frames
+    // they reference even though their pts is lower
+    auto it = m_inFlight.find(pts);
+    if (it == m_inFlight.end()) { return; }
+
+    const double latency =
+            std::chrono::duration<double>(Clock::now() - it->second).count();
+    m_inFlight.erase(it);
+
+    std::lock_guard<std::mutex> lk(m_lock);
+    if (int(m_samples.size()) < m_window) {
+        m_samples.push_back(latency);
+    } else {
+        m_samples[m_next] = latency;
+    }
+
+    m_next = (m_next + 1) % m_window;
+    ++m_frames;
+}
+
+atg_dtv::LatencyStats::Summary atg_dtv::LatencyStats::getSummary() {
+    std::vector<double> samples;
+    Summary summary;
+    {
+        std::lock_guard<std::mutex> lk(m_lock);
+        samples = m_samples;
+        summary.frames = m_frames;
+    }
+
+    if (samples.empty()) { return summary; }
+
+    summary.p50 = percentile(samples, 0.50);
+    summary.p90 = percentile(samples, 0.90);
+    summary.p99 = percentile(samples, 0.99);
+    summary.max = *std::max_element(samples.begin(), samples.end());
+
+    return summary;
+}
@@ -0,0 +1,332 @@
+#include "../include/dtv/shared_ring.h"
+
+#include <algorithm>
+#include <atomic>
+#include <climits>
+#include <cstring>
+#include <new>
+
+#if defined(__linux__)
+#include <cerrno>
+#include <fcntl.h>
+#include <linux/futex.h>
+#include <signal.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include <time.h>
+#include <unistd.h>
+#endif
+
+const uint32_t SharedRingMagic = 0x52545644; // "DVTR"
+const uint32_t SharedRingVersion = 2;
+const size_t MaxConfigSize = 16384;
+const size_t SlotAlignment = 64;
+const size_t HeaderAlignment = 4096;
+
+// Both processes map the same header, so it only holds plain data and
+// lock-free atomics
+struct SharedRingHeader {
+    std::atomic<uint32_t> magic;
+    uint32_t version;
+
+    int32_t capacity;
+    int32_t maxWidth;
+    int32_t maxHeight;
+    int32_t lineWidth;
+    int32_t audioCapacity;
+    uint32_t configSize;
+
+    std::atomic<uint32_t> counters[int(atg_dtv::SharedRing::Counter::Count)];
+    std::atomic<int32_t> error;
+    std::atomic<int32_t> creatorPid;
+    std::atomic<uint32_t> restarts;
+    std::atomic<int64_t> frameOffset;
+
+    // Frames measured, then p50, p90, p99 and max in nanoseconds; the fields
+    // are updated one at a time
+    std::atomic<int64_t> latencyFrames;
+    std::atomic<int64_t> latency[4];
+
+    char config[MaxConfigSize];
+};
+
+size_t alignSize(size_t size, size_t alignment) {
+    return (size + alignment - 1) / alignment * alignment;
+}
+
+atg_dtv::SharedRing::SharedRing() {
+    m_owner = false;
+    m_header = nullptr;
+    m_slots = nullptr;
+    m_size = 0;
+    m_slotSize = 0;
+    m_pixelsOffset = 0;
+    m_audioOffset = 0;
+}
+
+atg_dtv::SharedRing::~SharedRing() { close(); }
+
+bool atg_dtv::SharedRing::isSupported() {
+#if defined(__linux__)
+    return true;
+#else
+    return false;
+#endif
+}
+
+std::string atg_dtv::SharedRing::uniqueName() {
+    static std::atomic<int> rings(0);
+
+#if defined(__linux__)
+    const int pid = int(getpid());
+#else
+    const int pid = 0;
+#endif
+
+    return "/dtv-" + std::to_string(pid) + "-" + std::to_string(rings++);
+}
+
+bool atg_dtv::SharedRing::create(const std::string &name, const Layout &layout,
+                                 const std::string &config) {
+    close();
+
+    if (config.size() > MaxConfigSize || layout.capacity <= 0) {
+        return false;
+    }
+
+    m_name = name;
+    m_layout = layout;
+    m_config = config;
+
+    if (!map(computeOffsets(), true)) {
+        close();
+        return false;
+    }
+
+    m_owner = true;
+
+    SharedRingHeader *header = new (m_header) SharedRingHeader;
+    header->version = SharedRingVersion;
+    header->capacity = layout.capacity;
+    header->maxWidth = layout.maxWidth;
+    header->maxHeight = layout.maxHeight;
+    header->lineWidth = layout.lineWidth;
+    header->audioCapacity = layout.audioCapacity;
+    header->configSize = uint32_t(config.size());
+    memcpy(header->config, config.data(), config.size());
+
+    for (std::atomic<uint32_t> &counter : header->counters) { counter = 0; }
+    header->error = 0;
+    header->restarts = 0;
+    header->frameOffset = 0;
+    header->latencyFrames = 0;
+    for (std::atomic<int64_t> &latency : header->latency) { latency = 0; }
+
+#if defined(__linux__)
+    header->creatorPid = int32_t(getpid());
+#else
+    header->creatorPid = 0;
+#endif
+
+    // Published last so that an attaching process sees a complete header
+    header->magic.store(SharedRingMagic, std::memory_order_release);
+
+    return true;
+}
+
+bool atg_dtv::SharedRing::attach(const std::string &name) {
+    close();
+
+    m_name = name;
+    m_owner = false;
+
+    // The header describes the rest of the segment
+    if (!map(sizeof(SharedRingHeader), false) ||
+        m_header->magic.load(std::memory_order_acquire) != SharedRingMagic ||
+        m_header->version != SharedRingVersion) {
+        close();
+        return false;
+    }
+
+    m_layout.capacity = m_header->capacity;
+    m_layout.maxWidth = m_header->maxWidth;
+    m_layout.maxHeight = m_header->maxHeight;
+    m_layout.lineWidth = m_header->lineWidth;
+    m_layout.audioCapacity = m_header->audioCapacity;
+    m_config.assign(m_header->config,
+                    std::min<size_t>(m_header->configSize, MaxConfigSize));
+
+    if (!map(computeOffsets(), false)) {
+        close();
+        return false;
+    }
+
+    return true;
+}
+
+void atg_dtv::SharedRing::close() {
+#if defined(__linux__)
+    if (m_header != nullptr) { munmap(m_header, m_size); }
+    if (m_owner) { shm_unlink(m_name.c_str()); }
+#endif
+
+    m_header = nullptr;
+    m_slots = nullptr;
+    m_size = 0;
+    m_owner = false;
+    m_layout = Layout();
+    m_config.clear();
+}
+
+void atg_dtv::SharedRing::unlink() {
+#if defined(__linux__)
+    shm_unlink(m_name.c_str());
+#endif
+
+    m_owner = false;
+}
+
+atg_dtv::SharedRing::Slot *atg_dtv::SharedRing::getSlot(int index) {
+    return reinterpret_cast<Slot *>(m_slots + m_slotSize * size_t(index));
+}
+
+uint8_t *atg_dtv::SharedRing::getPixels(int index) {
+    if (m_layout.lineWidth == 0) { return nullptr; }
+    return m_slots + m_slotSize * size_t(index) + m_pixelsOffset;
+}
+
+int16_t *atg_dtv::SharedRing::getAudio(int index) {
+    if (m_layout.audioCapacity == 0) { return nullptr; }
+    return reinterpret_cast<int16_t *>(m_slots + m_slotSize * size_t(index) +
+                                       m_audioOffset);
+}
+
+uint32_t atg_dtv::SharedRing::load(Counter counter) const {
+    return m_header->counters[int(counter)].load(std::memory_order_acquire);
+}
+
+void atg_dtv::SharedRing::store(Counter counter, uint32_t value) {
+    m_header->counters[int(counter)].store(value, std::memory_order_release);
+}
+
+void atg_dtv::SharedRing::wake(Counter counter) {
+#if defined(__linux__)
+    // Not FUTEX_PRIVATE_FLAG, since the waiter may be in another process
+    syscall(SYS_futex, &m_header->counters[int(counter)], FUTEX_WAKE, INT_MAX,
+            nullptr, nullptr, 0);
+#endif
+}
+
+bool atg_dtv::SharedRing::wait(Counter counter, uint32_t value,
+                               int timeoutMs) {
+    std::atomic<uint32_t> *word = &m_header->counters[int(counter)];
+    if (word->load(std::memory_order_acquire) != value) { return true; }
+
+#if defined(__linux__)
+    timespec timeout;
+    timeout.tv_sec = timeoutMs / 1000;
+    timeout.tv_nsec = long(timeoutMs % 1000) * 1000000L;
+    syscall(SYS_futex, word, FUTEX_WAIT, value, &timeout, nullptr, 0);
+#endif
+
+    return word->load(std::memory_order_acquire) != value;
+}
+
+void atg_dtv::SharedRing::setError(int error) { m_header->error = error; }
+
+int atg_dtv::SharedRing::getError() const { return m_header->error; }
+
+int atg_dtv::SharedRing::getRestarts() const {
+    return int(m_header->restarts);
+}
+
+void atg_dtv::SharedRing::addRestart() { ++m_header->restarts; }
+
+void atg_dtv::SharedRing::setFrameOffset(int64_t frameOffset) {
+    m_header->frameOffset = frameOffset;
+}
+
+int64_t atg_dtv::SharedRing::getFrameOffset() const {
+    return m_header->frameOffset;
+}
+
+bool atg_dtv::SharedRing::isCreatorAlive() const {
+#if defined(__linux__)
+    const pid_t pid = pid_t(m_header->creatorPid.load());
+    return pid > 0 && (kill(pid, 0) == 0 || errno == EPERM);
+#else
+    return false;
+#endif
+}
+
+void atg_dtv::SharedRing::setLatency(const LatencyStats::Summary &summary) {
+    const double values[] = {summary.p50, summary.p90, summary.p99,
+                             summary.max};
+    for (int i = 0; i < 4; ++i) {
+        m_header->latency[i] = int64_t(values[i] * 1e9);
+    }
+
+    m_header->latencyFrames = summary.frames;
+}
+
+atg_dtv::LatencyStats::Summary atg_dtv::SharedRing::getLatency() const {
+    LatencyStats::Summary summary;
+    summary.frames = m_header->latencyFrames;
+    summary.p50 = m_header->latency[0] / 1e9;
+    summary.p90 = m_header->latency[1] / 1e9;
+    summary.p99 = m_header->latency[2] / 1e9;
+    summary.max = m_header->latency[3] / 1e9;
+
+    return summary;
+}
+
+size_t atg_dtv::SharedRing::computeOffsets() {
+    m_pixelsOffset = alignSize(sizeof(Slot), SlotAlignment);
+    m_audioOffset = m_pixelsOffset +
+                    alignSize(size_t(m_layout.lineWidth) * m_layout.maxHeight,
+                              SlotAlignment);
+    m_slotSize = m_audioOffset +
+                 alignSize(sizeof(int16_t) * m_layout.audioCapacity,
+                           SlotAlignment);
+
+    return alignSize(sizeof(SharedRingHeader), HeaderAlignment) +
+           m_slotSize * size_t(m_layout.capacity);
+}
+
+bool atg_dtv::SharedRing::map(size_t size, bool create) {
+#if defined(__linux__)
+    if (m_header != nullptr) {
+        munmap(m_header, m_size);
+        m_header = nullptr;
+    }
+
+    const int fd = shm_open(m_name.c_str(),
+                            create ? (O_CREAT | O_EXCL | O_RDWR) : O_RDWR,
+                            S_IRUSR | S_IWUSR);
+    if (fd < 0) { return false; }
+
+    void *data = MAP_FAILED;
+    if (!create || ftruncate(fd, off_t(size)) == 0) {
+        data = mmap(nullptr, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    }
+
+    ::close(fd);
+
+    if (data == MAP_FAILED) {
+        if (create) { shm_unlink(m_name.c_str()); }
+        return false;
+    }
+
+    m_header = static_cast<SharedRingHeader *>(data);
+    m_slots = static_cast<uint8_t *>(data) +
+              alignSize(sizeof(SharedRingHeader), HeaderAlignment);
+    m_size = size;
+
+    return true;
+#else
+    (void) size;
+    (void) create;
+    return false;
+#endif
+}
@@ -0,0 +1,120 @@
+#include "../include/dtv/speed_governor.h"
+
+#include "../include/dtv/ffmpeg.h"
+
+namespace {
+// Ordered from highest quality to fastest
+const atg_dtv::SpeedGovernor::Level Levels[] = {
+        {"veryfast", "slow", SWS_BICUBIC},
+        {"superfast", "medium", SWS_BICUBIC},
+        {"ultrafast", "fast", SWS_BICUBIC},
+        {"ultrafast", "fast", SWS_BILINEAR},
+        {"ultrafast", "fast", SWS_FAST_BILINEAR},
+};
+
+const int LevelCount = sizeof(Levels) / sizeof(Levels[0]);
+
+// Matches the ultrafast/bicubic defaults used without adaptiveSpeed
+const int BaselineLevel = 2;
+} /* namespace */
+
+atg_dtv::SpeedGovernor::SpeedGovernor() {
+    m_targetFrameTime = 0.0;
+
+    m_level = 0;
+    m_minLevel = 0;
+    m_relaxedCount = 0;
+
+    m_samples = 0;
+    m_occupancySamples = 0;
+    m_occupancyTotal = 0.0;
+    m_encodeTimeTotal = 0.0;
+
+    m_lastOccupancy = 0.0;
+    m_lastEncodeTime = 0.0;
+}
+
+atg_dtv::SpeedGovernor::~SpeedGovernor() {}
+
+void atg_dtv::SpeedGovernor::initialize(const Settings &settings,
+                                        double targetFrameTime) {
+    m_settings = settings;
+    m_targetFrameTime = (settings.targetFrameTime > 0.0)
+                                ? settings.targetFrameTime
+                                : targetFrameTime;
+
+    m_level = (settings.initialLevel < 0) ? BaselineLevel
+                                          : settings.initialLevel;
+    if (m_level >= LevelCount) { m_level = LevelCount - 1; }
+
+    m_minLevel = 0;
+    m_relaxedCount = 0;
+    m_samples = 0;
+    m_occupancySamples = 0;
+    m_occupancyTotal = 0.0;
+    m_encodeTimeTotal = 0.0;
+    m_lastOccupancy = 0.0;
+    m_lastEncodeTime = 0.0;
+}
+
+void atg_dtv::SpeedGovernor::recordFrame(int queueLength, int queueCapacity,
+                                         double encodeTime) {
+    // A single-slot queue (lowLatency) reads as full whenever a frame is
+    // waiting, so only the encode time says anything about it
+    if (queueCapacity > 1) {
+        m_occupancyTotal += double(queueLength) / queueCapacity;
+        ++m_occupancySamples;
+    }
+
+    m_encodeTimeTotal += encodeTime;
+    ++m_samples;
+}
+
+int atg_dtv::SpeedGovernor::evaluate() {
+    if (m_samples == 0) { return m_level; }
+
+    m_lastOccupancy = (m_occupancySamples > 0)
+                              ? m_occupancyTotal / m_occupancySamples
+                              : 0.0;
+    m_lastEncodeTime = m_encodeTimeTotal / m_samples;
+
+    m_samples = 0;
+    m_occupancySamples = 0;
+    m_occupancyTotal = 0.0;
+    m_encodeTimeTotal = 0.0;
+
+    const bool pressure = m_lastOccupancy >= m_settings.highWatermark ||
+                          m_lastEncodeTime > m_targetFrameTime;
+    const bool relaxed =
+            m_lastOccupancy <= m_settings.lowWatermark &&
+            m_lastEncodeTime < m_targetFrameTime * m_settings.relaxRatio;
+
+    if (pressure) {
+        m_relaxedCount = 0;
+        if (m_level < LevelCount - 1) { ++m_level; }
+    } else if (relaxed) {
+        if (++m_relaxedCount >= m_settings.relaxEvaluations &&
+            m_level > m_minLevel) {
+            --m_level;
+            m_relaxedCount = 0;
+        }
+    } else {
+        m_relaxedCount = 0;
+    }
+
+    return m_level;
+}
+
+void atg_dtv::SpeedGovernor::setMinLevel(int level) {
+    m_minLevel = (level < LevelCount) ? level : LevelCount - 1;
+    if (m_level < m_minLevel) { m_level = m_minLevel; }
+}
+
+int atg_dtv::SpeedGovernor::getLevelCount() { return LevelCount; }
+
+int atg_dtv::SpeedGovernor::getBaselineLevel() { return BaselineLevel; }
+
+const atg_dtv::SpeedGovernor::Level &
+atg_dtv::SpeedGovernor::getLevelSettings(int level) {
+    return Levels[level];
+}
@@ -0,0 +1,401 @@
+#include "../include/dtv/spill_file.h"
+
+#include <algorithm>
+#include <cstring>
+
+// Frames are written and read back by the same process, so plain structs are
+// enough for the record layout
+struct SpillRecord {
+    int32_t width;
+    int32_t height;
+    int32_t keyframe;
+    int32_t audioSamples;
+    int32_t audioChannels;
+    int32_t rowBytes;
+    uint64_t convertedSize;
+    int64_t submitTime;
+};
+
+struct SpillPayload {
+    uint64_t storedSize;
+    uint32_t compressed;
+    uint32_t reserved;
+};
+
+// LZ4 block format: sequences of literals followed by a back-reference of at
+// least four bytes within the previous 64 KiB
+const int MinMatch = 4;
+const int LastLiterals = 5;
+const int MatchSearchLimit = 12;
+const int HashLog = 16;
+const int MaxOffset = 65535;
+
+// Spill files can outgrow a 32-bit long
+int64_t tellFile(FILE *file) {
+#if defined(_WIN32)
+    return _ftelli64(file);
+#else
+    return int64_t(ftello(file));
+#endif
+}
+
+bool seekFile(FILE *file, int64_t offset) {
+#if defined(_WIN32)
+    return _fseeki64(file, offset, SEEK_SET) == 0;
+#else
+    return fseeko(file, off_t(offset), SEEK_SET) == 0;
+#endif
+}
+
+size_t lz4Bound(size_t size) { return size + size / 255 + 16; }
+
+uint32_t read32(const uint8_t *p) {
+    uint32_t v;
+    memcpy(&v, p, sizeof(v));
+    return v;
+}
+
+uint32_t lz4Hash(uint32_t sequence) {
+    return (sequence * 2654435761U) >> (32 - HashLog);
+}
+
+uint8_t *writeLength(uint8_t *op, size_t length) {
+    for (; length >= 255; length -= 255) { *op++ = 255; }
+    *op++ = uint8_t(length);
+    return op;
+}
+
+uint8_t *writeSequence(uint8_t *op, const uint8_t *literals,
+                       size_t literalLength, int offset, size_t matchLength) {
+    uint8_t *token = op++;
+    *token = uint8_t(std::min(literalLength, size_t(15)) << 4);
+    if (literalLength >= 15) { op = writeLength(op, literalLength - 15); }
+
+    memcpy(op, literals, literalLength);
+    op += literalLength;
+
+    // The final sequence is literals only
+    if (matchLength == 0) { return op; }
+
+    *op++ = uint8_t(offset & 0xFF);
+    *op++ = uint8_t(offset >> 8);
+
+    matchLength -= MinMatch;
+    *token |= uint8_t(std::min(matchLength, size_t(15)));
+    if (matchLength >= 15) { op = writeLength(op, matchLength - 15); }
+
+    return op;
+}
+
+size_t lz4Compress(const uint8_t *src, size_t size, uint8_t *dst,
+                   std::vector<int> &table) {
+    table.assign(size_t(1) << HashLog, -1);
+
+    uint8_t *op = dst;
+    size_t anchor = 0;
+    size_t ip = 0;
+
+    if (size > size_t(MatchSearchLimit)) {
+        const size_t searchEnd = size - MatchSearchLimit;
+        const size_t matchEnd = size - LastLiterals;
+        while (ip < searchEnd) {
+            const uint32_t sequence = read32(src + ip);
+            const uint32_t h = lz4Hash(sequence);
+            const int ref = table[h];
+            table[h] = int(ip);
+
+            if (ref < 0 || ip - size_t(ref) > size_t(MaxOffset) ||
+                read32(src + ref) != sequence) {
+                // Skip faster through data that does not compress
+                ip += 1 + ((ip - anchor) >> 6);
+                continue;
+            }
+
+            size_t length = MinMatch;
+            while (ip + length < matchEnd &&
+                   src[ref + length] == src[ip + length]) {
+                ++length;
+            }
+
+            op = writeSequence(op, src + anchor, ip - anchor,
+                               int(ip - size_t(ref)), length);
+            ip += length;
+            anchor = ip;
+        }
+    }
+
+    op = writeSequence(op, src + anchor, size - anchor, 0, 0);
+    return size_t(op - dst);
+}
+
+bool readLength(const uint8_t *src, size_t size, size_t *ip,
+                size_t *length) {
+    uint8_t b;
+    do {
+        if (*ip >= size) { return false; }
+        b = src[(*ip)++];
+        *length += b;
+    } while (b == 255);
+
+    return true;
+}
+
+bool lz4Decompress(const uint8_t *src, size_t size, uint8_t *dst,
+                   size_t dstSize) {
+    size_t ip = 0, op = 0;
+    while (ip < size) {
+        const uint8_t token = src[ip++];
+
+        size_t literalLength = token >> 4;
+        if (literalLength == 15 &&
+            !readLength(src, size, &ip, &literalLength)) {
+            return false;
+        }
+
+        if (literalLength > size - ip || literalLength > dstSize - op) {
+            return false;
+        }
+
+        memcpy(dst + op, src + ip, literalLength);
+        ip += literalLength;
+        op += literalLength;
+
+        if (ip == size) { break; }
+        if (size - ip < 2) { return false; }
+
+        const size_t offset = size_t(src[ip]) | (size_t(src[ip + 1]) << 8);
+        ip += 2;
+        if (offset == 0 || offset > op) { return false; }
+
+        size_t matchLength = token & 15;
+        if (matchLength == 15 && !readLength(src, size, &ip, &matchLength)) {
+            return false;
+        }
+
+        matchLength += MinMatch;
+        if (matchLength > dstSize - op) { return false; }
+
+        // Matches may overlap the bytes they produce
+        for (size_t i = 0; i < matchLength; ++i, ++op) {
+            dst[op] = dst[op - offset];
+        }
+    }
+
+    return op == dstSize;
+}
+
+atg_dtv::SpillFile::SpillFile() {
+    m_writer = nullptr;
+    m_reader = nullptr;
+    m_compress = false;
+    m_pixelSize = 0;
+    m_recordStart = 0;
+}
+
+atg_dtv::SpillFile::~SpillFile() { close(); }
+
+bool atg_dtv::SpillFile::open(const std::string &fname, bool compress,
+                              int pixelSize) {
+    close();
+
+    m_fname = fname;
+    m_compress = compress;
+    m_pixelSize = pixelSize;
+    m_recordStart = 0;
+
+    m_writer = fopen(fname.c_str(), "wb");
+    if (m_writer != nullptr) { m_reader = fopen(fname.c_str(), "rb"); }
+    if (m_reader == nullptr) {
+        close();
+        return false;
+    }
+
+    // Read-ahead could pick up a record that is still being written
+    setvbuf(m_reader, nullptr, _IONBF, 0);
+
+    return true;
+}
+
+void atg_dtv::SpillFile::close() {
+    if (m_reader != nullptr) { fclose(m_reader); }
+    if (m_writer != nullptr) {
+        fclose(m_writer);
+        remove(m_fname.c_str());
+    }
+
+    m_reader = nullptr;
+    m_writer = nullptr;
+
+    m_rows.clear();
+    m_rows.shrink_to_fit();
+    m_compressed.clear();
+    m_compressed.shrink_to_fit();
+    m_hashTable.clear();
+    m_hashTable.shrink_to_fit();
+    m_input.clear();
+    m_input.shrink_to_fit();
+    m_unpacked.clear();
+    m_unpacked.shrink_to_fit();
+}
+
+size_t atg_dtv::SpillFile::write(const Frame &frame, int audioChannels) {
+    const int64_t start = tellFile(m_writer);
+    if (start < 0) { return 0; }
+
+    const size_t written = writeRecord(frame, audioChannels);
+    if (written > 0) {
+        m_recordStart = start;
+        return written;
+    }
+
+    // The next record overwrites whatever part of this one got out
+    clearerr(m_writer);
+    seekFile(m_writer, start);
+
+    return 0;
+}
+
+size_t atg_dtv::SpillFile::writeRecord(const Frame &frame,
+                                       int audioChannels) {
+    int stride = 0;
+    const uint8_t *pixels = frame.getPixels(&stride);
+
+    SpillRecord record;
+    record.width = frame.m_width;
+    record.height = frame.m_height;
+    record.keyframe = frame.m_keyframe ? 1 : 0;
+    record.audioSamples = frame.m_audioSamples;
+    record.audioChannels = audioChannels;
+    record.rowBytes = (pixels != nullptr) ? frame.m_width * m_pixelSize : 0;
+    record.convertedSize =
+            (frame.m_converted != nullptr) ? frame.m_convertedCapacity : 0;
+    record.submitTime = frame.m_submitTime.time_since_epoch().count();
+
+    size_t written = sizeof(record);
+    if (fwrite(&record, sizeof(record), 1, m_writer) != 1) { return 0; }
+
+    // Rows are packed so that padding and flips are not stored
+    const size_t rowBytes = size_t(record.rowBytes);
+    m_rows.resize(rowBytes * size_t(record.height));
+    for (int y = 0; y < record.height && rowBytes > 0; ++y) {
+        memcpy(m_rows.data() + rowBytes * y, pixels + ptrdiff_t(y) * stride,
+               rowBytes);
+    }
+
+    const size_t audioSize = sizeof(int16_t) * size_t(record.audioSamples) *
+                             size_t(audioChannels);
+    if (!writePayload(m_rows.data(), m_rows.size(), &written) ||
+        !writePayload(frame.m_converted, size_t(record.convertedSize),
+                      &written) ||
+        !writePayload(reinterpret_cast<const uint8_t *>(frame.m_audio),
+                      audioSize, &written)) {
+        return 0;
+    }
+
+    // The reader only sees what has reached the OS
+    if (fflush(m_writer) != 0) { return 0; }
+
+    return written;
+}
+
+size_t atg_dtv::SpillFile::read(Frame *frame) {
+    SpillRecord record;
+    if (fread(&record, sizeof(record), 1, m_reader) != 1) { return 0; }
+
+    // Slots that already have pixel storage keep their own line width
+    const int lineWidth = (record.rowBytes + 63) & ~63;
+    frame->allocate(record.width, record.height, lineWidth,
+                    record.audioSamples, record.audioChannels,
+                    size_t(record.convertedSize));
+    frame->m_flip = false;
+    frame->m_keyframe = record.keyframe != 0;
+    frame->m_submitTime = std::chrono::steady_clock::time_point(
+            std::chrono::steady_clock::duration(record.submitTime));
+
+    size_t read = sizeof(record);
+
+    const size_t rowBytes = size_t(record.rowBytes);
+    m_unpacked.resize(rowBytes * size_t(record.height));
+    if (!readPayload(m_unpacked.data(), m_unpacked.size(), &read)) {
+        return 0;
+    }
+
+    for (int y = 0; y < record.height && rowBytes > 0; ++y) {
+        memcpy(frame->m_rgb + size_t(frame->m_lineWidth) * y,
+               m_unpacked.data() + rowBytes * y, rowBytes);
+    }
+
+    const size_t audioSize = sizeof(int16_t) * size_t(record.audioSamples) *
+                             size_t(record.audioChannels);
+    if (!readPayload(frame->m_converted, size_t(record.convertedSize),
+                     &read) ||
+        !readPayload(reinterpret_cast<uint8_t *>(frame->m_audio), audioSize,
+                     &read)) {
+        return 0;
+    }
+
+    return read;
+}
+
+void atg_dtv::SpillFile::rewind() {
+    fseek(m_writer, 0, SEEK_SET);
+    fseek(m_reader, 0, SEEK_SET);
+    m_recordStart = 0;
+}
+
+void atg_dtv::SpillFile::skipToLastRecord() {
+    clearerr(m_reader);
+    seekFile(m_reader, m_recordStart);
+}
+
+bool atg_dtv::SpillFile::writePayload(const uint8_t *data, size_t size,
+                                      size_t *written) {
+    if (size == 0) { return true; }
+
+    SpillPayload payload;
+    payload.storedSize = size;
+    payload.compressed = 0;
+    payload.reserved = 0;
+
+    const uint8_t *stored = data;
+    if (m_compress) {
+        m_compressed.resize(lz4Bound(size));
+        const size_t compressedSize =
+                lz4Compress(data, size, m_compressed.data(), m_hashTable);
+
+        // Incompressible data is kept as it is
+        if (compressedSize < size) {
+            payload.storedSize = compressedSize;
+            payload.compressed = 1;
+            stored = m_compressed.data();
+        }
+    }
+
+    if (fwrite(&payload, sizeof(payload), 1, m_writer) != 1 ||
+        fwrite(stored, 1, size_t(payload.storedSize), m_writer) !=
+                size_t(payload.storedSize)) {
+        return false;
+    }
+
+    *written += sizeof(payload) + size_t(payload.storedSize);
+    return true;
+}
+
+bool atg_dtv::SpillFile::readPayload(uint8_t *data, size_t size,
+                                     size_t *read) {
+    if (size == 0) { return true; }
+
+    SpillPayload payload;
+    if (fread(&payload, sizeof(payload), 1, m_reader) != 1) { return false; }
+
+    const size_t storedSize = size_t(payload.storedSize);
+    *read += sizeof(payload) + storedSize;
+
+    if (payload.compressed == 0) {
+        return storedSize == size && fread(data, 1, size, m_reader) == size;
+    }
+
+    m_input.resize(storedSize);
+    return fread(m_input.data(), 1, storedSize, m_reader) == storedSize &&
+           lz4Decompress(m_input.data(), storedSize, data, size);
+}
@@ -0,0 +1,156 @@
+#include "../include/dtv/thread_pool.h"
+
+#include "../include/dtv/trace.h"
+
+#include <assert.h>
+
+#if defined(_WIN32)
+#define WIN32_LEAN_AND_MEAN
+#define NOMINMAX
+#include <windows.h>
+#elif defined(__linux__)
+#include <sys/resource.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+#endif
+
+namespace {
+// Lets submit() find the queue of the calling pool thread
+thread_local const atg_dtv::ThreadPool *t_pool = nullptr;
+thread_local int t_queue = -1;
+} /* namespace */
+
+atg_dtv::ThreadPool::ThreadPool() {
+    m_threads = nullptr;
+    m_queues = nullptr;
+    m_threadCount = 0;
+    m_priority = Priority::Normal;
+    m_pending = 0;
+    m_active = 0;
+    m_nextQueue = 0;
+    m_stopped = false;
+}
+
+atg_dtv::ThreadPool::~ThreadPool() { destroy(); }
+
+void atg_dtv::ThreadPool::initialize(int threadCount, Priority priority) {
+    assert(m_threads == nullptr);
+
+    m_threadCount = (threadCount > 0) ? threadCount : 1;
+    m_priority = priority;
+    m_pending = 0;
+    m_active = 0;
+    m_nextQueue = 0;
+    m_stopped = false;
+
+    m_queues = new WorkerQueue[m_threadCount];
+    m_threads = new std::thread[m_threadCount];
+    for (int i = 0; i < m_threadCount; ++i) {
+        m_threads[i] = std::thread(&atg_dtv::ThreadPool::worker, this, i);
+    }
+}
+
+void atg_dtv::ThreadPool::destroy() {
+    if (m_threads == nullptr) { return; }
+
+    {
+        std::lock_guard<std::mutex> lk(m_lock);
+        m_stopped = true;
+    }
+
+    m_cv.notify_all();
+
+    for (int i = 0; i < m_threadCount; ++i) { m_threads[i].join(); }
+
+    delete[] m_threads;
+    m_threads = nullptr;
+
+    delete[] m_queues;
+    m_queues = nullptr;
+    m_threadCount = 0;
+}
+
+void atg_dtv::ThreadPool::submit(const Task &task) {
+    {
+        std::lock_guard<std::mutex> lk(m_lock);
+
+        int index = t_queue;
+        if (t_pool != this) {
+            index = m_nextQueue;
+            m_nextQueue = (m_nextQueue + 1) % m_threadCount;
+        }
+
+        m_queues[index].tasks.push_back(task);
+        ++m_pending;
+    }
+
+    m_cv.notify_one();
+}
+
+void atg_dtv::ThreadPool::wait() {
+    std::unique_lock<std::mutex> lk(m_lock);
+    m_idle.wait(lk, [this] { return m_pending == 0 && m_active == 0; });
+}
+
+void atg_dtv::ThreadPool::setCurrentThreadPriority(Priority priority) {
+#if defined(_WIN32)
+    SetThreadPriority(GetCurrentThread(), (priority == Priority::Low)
+                                                  ? THREAD_PRIORITY_BELOW_NORMAL
+                                                  : THREAD_PRIORITY_NORMAL);
+#elif defined(__linux__)
+    // Niceness is a per-thread attribute on Linux
+    setpriority(PRIO_PROCESS, (id_t) syscall(SYS_gettid),
+                (priority == Priority::Low) ? 10 : 0);
+#else
+    (void) priority;
+#endif
+}
+
+void atg_dtv::ThreadPool::worker(int index) {
+    DTV_TRACE_THREAD_NAME("dtv pool");
+
+    t_pool = this;
+    t_queue = index;
+
+    if (m_priority != Priority::Normal) {
+        setCurrentThreadPriority(m_priority);
+    }
+
+    std::unique_lock<std::mutex> lk(m_lock);
+    while (true) {
+        m_cv.wait(lk, [this] { return m_pending > 0 || m_stopped; });
+
+        // Queued tasks are always drained before the pool shuts down
+        if (m_pending == 0) { break; }
+
+        // A pending count always has a queued task behind it
+        Task task = popTask(index);
+        --m_pending;
+        ++m_active;
+        lk.unlock();
+
+        task();
+
+        lk.lock();
+        --m_active;
+        if (m_pending == 0 && m_active == 0) { m_idle.notify_all(); }
+    }
+
+    t_pool = nullptr;
+    t_queue = -1;
+}
+
+atg_dtv::ThreadPool::Task atg_dtv::ThreadPool::popTask(int index) {
+    // The thread's own list comes first, then the others
+    for (int i = 0; i < m_threadCount; ++i) {
+        std::deque<Task> &tasks = m_queues[(index + i) % m_threadCount].tasks;
+        if (!tasks.empty()) {
+            Task task = std::move(tasks.front());
+            tasks.pop_front();
+            return task;
+        }
+    }
+
+    assert(false);
+    return Task();
+}
@@ -0,0 +1,157 @@
+#include "../include/dtv/trace.h"
+
+#include <chrono>
+#include <cstdio>
+#include <mutex>
+#include <vector>
+
+namespace {
+// Each thread appends to its own buffer; the writer publishes new events by
+// bumping the count, so recording never takes a lock
+struct ThreadBuffer {
+    ThreadBuffer(int capacity, int threadId, const char *name, int generation)
+        : events(new atg_dtv::Trace::Event[capacity]), capacity(capacity),
+          count(0), dropped(0), threadId(threadId), name(name),
+          generation(generation) {}
+
+    // Only called by the owning thread, with the registry locked so that a
+    // dump isn't reading the old events
+    void reset(int newCapacity, int newGeneration) {
+        if (newCapacity != capacity) {
+            delete[] events;
+            events = new atg_dtv::Trace::Event[newCapacity];
+            capacity = newCapacity;
+        }
+
+        count.store(0, std::memory_order_relaxed);
+        dropped.store(0, std::memory_order_relaxed);
+        generation = newGeneration;
+    }
+
+    atg_dtv::Trace::Event *events;
+    int capacity;
+    std::atomic<int> count;
+    std::atomic<int> dropped;
+    int threadId;
+    std::atomic<const char *> name;
+
+    // The enable() call the events belong to
+    int generation;
+};
+
+std::mutex g_registryLock;
+
+// Buffers are never freed so that events from finished threads can still be
+// dumped
+std::vector<ThreadBuffer *> g_buffers;
+std::atomic<int> g_capacity(1 << 16);
+std::atomic<int> g_generation(0);
+
+thread_local ThreadBuffer *t_buffer = nullptr;
+thread_local const char *t_threadName = nullptr;
+
+const std::chrono::steady_clock::time_point g_epoch =
+        std::chrono::steady_clock::now();
+
+ThreadBuffer *threadBuffer() {
+    if (t_buffer == nullptr) {
+        std::lock_guard<std::mutex> lk(g_registryLock);
+        t_buffer = new ThreadBuffer(g_capacity.load(),
+                                    int(g_buffers.size()) + 1, t_threadName,
+                                    g_generation.load());
+        g_buffers.push_back(t_buffer);
+    } else if (t_buffer->generation !=
+               g_generation.load(std::memory_order_relaxed)) {
+        // Events from before the last enable() are discarded lazily, since
+        // only this thread may touch its buffer while recording
+        std::lock_guard<std::mutex> lk(g_registryLock);
+        t_buffer->reset(g_capacity.load(), g_generation.load());
+    }
+
+    return t_buffer;
+}
+} /* namespace */
+
+std::atomic<bool> atg_dtv::Trace::s_enabled(false);
+
+void atg_dtv::Trace::enable(int eventsPerThread) {
+    {
+        std::lock_guard<std::mutex> lk(g_registryLock);
+        g_capacity.store((eventsPerThread > 0) ? eventsPerThread : 1);
+        ++g_generation;
+    }
+
+    s_enabled.store(true);
+}
+
+void atg_dtv::Trace::disable() { s_enabled.store(false); }
+
+bool atg_dtv::Trace::dump(const std::string &fname) {
+    FILE *file = fopen(fname.c_str(), "w");
+    if (file == nullptr) { return false; }
+
+    std::lock_guard<std::mutex> lk(g_registryLock);
+
+    int dropped = 0;
+    bool first = true;
+    fprintf(file, "{\"traceEvents\":[");
+    for (const ThreadBuffer *buffer : g_buffers) {
+        // Left over from an earlier trace
+        if (buffer->generation != g_generation.load()) { continue; }
+
+        const char *name = buffer->name.load(std::memory_order_acquire);
+        if (name != nullptr) {
+            fprintf(file,
+                    "%s\n{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":1,"
+                    "\"tid\":%d,\"args\":{\"name\":\"%s\"}}",
+                    first ? "" : ",", buffer->threadId, name);
+            first = false;
+        }
+
+        const int count = buffer->count.load(std::memory_order_acquire);
+        for (int i = 0; i < count; ++i) {
+            const Event &event = buffer->events[i];
+            fprintf(file,
+                    "%s\n{\"name\":\"%s\",\"ph\":\"X\",\"pid\":1,\"tid\":%d,"
+                    "\"ts\":%.3f,\"dur\":%.3f}",
+                    first ? "" : ",", event.name, buffer->threadId,
+                    event.begin / 1000.0, (event.end - event.begin) / 1000.0);
+            first = false;
+        }
+
+        dropped += buffer->dropped.load(std::memory_order_relaxed);
+    }
+
+    fprintf(file,
+            "\n],\"displayTimeUnit\":\"ms\",\"otherData\":{\"droppedEvents\":"
+            "%d}}\n",
+            dropped);
+
+    return fclose(file) == 0;
+}
+
+void atg_dtv::Trace::setThreadName(const char *name) {
+    t_threadName = name;
+    if (t_buffer != nullptr) {
+        t_buffer->name.store(name, std::memory_order_release);
+    }
+}
+
+void atg_dtv::Trace::record(const char *name, int64_t begin, int64_t end) {
+    ThreadBuffer *buffer = threadBuffer();
+
+    const int index = buffer->count.load(std::memory_order_relaxed);
+    if (index >= buffer->capacity) {
+        buffer->dropped.fetch_add(1, std::memory_order_relaxed);
+        return;
+    }
+
+    buffer->events[index] = Event{name, begin, end};
+    buffer->count.store(index + 1, std::memory_order_release);
+}
+
+int64_t atg_dtv::Trace::now() {
+    return std::chrono::duration_cast<std::chrono::nanoseconds>(
+                   std::chrono::steady_clock::now() - g_epoch)
+            .count();
+}
@@ -0,0 +1,323 @@
+#include "../include/dtv/transcoder.h"
+
+#include "../include/dtv/ffmpeg.h"
+#include "../include/dtv/trace.h"
+
+#include <cstdio>
+
+atg_dtv::Encoder::Error openInputStream(atg_dtv::InputStream *input,
+                                        const std::string &fname,
+                                        AVMediaType type, bool required) {
+    typedef atg_dtv::Encoder::Error Error;
+
+    if (avformat_open_input(&input->formatContext, fname.c_str(), nullptr,
+                            nullptr) < 0) {
+        return Error::CouldNotOpenInputFile;
+    }
+
+    if (avformat_find_stream_info(input->formatContext, nullptr) < 0) {
+        return Error::CouldNotOpenInputFile;
+    }
+
+    input->streamIndex = av_find_best_stream(input->formatContext, type, -1,
+                                             -1, nullptr, 0);
+    if (input->streamIndex < 0) {
+        input->streamIndex = -1;
+        return required ? Error::CouldNotFindDecoder : Error::None;
+    }
+
+    const AVCodecParameters *parameters =
+            input->formatContext->streams[input->streamIndex]->codecpar;
+    const AVCodec *codec = avcodec_find_decoder(parameters->codec_id);
+    if (codec == nullptr) { return Error::CouldNotFindDecoder; }
+
+    input->codecContext = avcodec_alloc_context3(codec);
+    if (input->codecContext == nullptr) { return Error::CouldNotOpenDecoder; }
+
+    if (avcodec_parameters_to_context(input->codecContext, parameters) < 0) {
+        return Error::CouldNotOpenDecoder;
+    }
+
+    input->codecContext->thread_count = 0;
+
+    if (avcodec_open2(input->codecContext, codec, nullptr) < 0) {
+        return Error::CouldNotOpenDecoder;
+    }
+
+    input->frame = av_frame_alloc();
+    if (input->frame == nullptr) { return Error::CouldNotAllocateFrame; }
+
+    input->packet = av_packet_alloc();
+    if (input->packet == nullptr) { return Error::CouldNotAllocatePacket; }
+
+    return Error::None;
+}
+
+void freeInputStream(atg_dtv::InputStream *input) {
+    if (input->codecContext != nullptr) {
+        avcodec_free_context(&input->codecContext);
+    }
+    if (input->frame != nullptr) { av_frame_free(&input->frame); }
+    if (input->packet != nullptr) { av_packet_free(&input->packet); }
+    if (input->formatContext != nullptr) {
+        avformat_close_input(&input->formatContext);
+    }
+
+    input->streamIndex = -1;
+    input->eof = false;
+}
+
+atg_dtv::Encoder::Error decodeFrame(atg_dtv::InputStream *input,
+                                    bool *decoded) {
+    typedef atg_dtv::Encoder::Error Error;
+
+    DTV_TRACE_SCOPE("decodeFrame");
+
+    *decoded = false;
+    while (true) {
+        const int r = avcodec_receive_frame(input->codecContext, input->frame);
+        if (r == 0) {
+            *decoded = true;
+            return Error::None;
+        } else if (r == AVERROR_EOF) {
+            return Error::None;
+        } else if (r != AVERROR(EAGAIN)) {
+            return Error::CouldNotDecodeFrame;
+        }
+
+        if (av_read_frame(input->formatContext, input->packet) < 0) {
+            // Enter draining mode to collect any buffered frames
+            if (input->eof) { return Error::None; }
+            input->eof = true;
+            avcodec_send_packet(input->codecContext, nullptr);
+            continue;
+        }
+
+        if (input->packet->stream_index != input->streamIndex) {
+            av_packet_unref(input->packet);
+            continue;
+        }
+
+        const int s = avcodec_send_packet(input->codecContext, input->packet);
+        av_packet_unref(input->packet);
+
+        if (s < 0) { return Error::CouldNotDecodeFrame; }
+    }
+}
+
+atg_dtv::Transcoder::Transcoder() {
+    m_complete = false;
+    m_error = Encoder::Error::None;
+    m_bufferSize = 0;
+    m_totalFrames = 0;
+    m_swsContext = nullptr;
+    m_audioReadOffset = 0;
+    m_audioChannels = 0;
+}
+
+atg_dtv::Transcoder::~Transcoder() { destroy(); }
+
+void atg_dtv::Transcoder::initialize(
+        const std::string &source, const Encoder::VideoSettings &settings,
+        int bufferSize, int64_t totalFrames,
+        const Encoder::TranscodeCallback &callback) {
+    m_source = source;
+    m_settings = settings;
+    m_bufferSize = bufferSize;
+    m_totalFrames = totalFrames;
+    m_callback = callback;
+
+    m_complete = false;
+    m_error = Encoder::Error::None;
+}
+
+void atg_dtv::Transcoder::run() {
+    const Encoder::Error err = transcode();
+    destroy();
+
+    if (err == Encoder::Error::None && !m_settings.keepIntermediate) {
+        std::remove(m_source.c_str());
+    }
+
+    reportProgress(m_totalFrames, true, err);
+
+    // The owner may destroy this object as soon as it observes completion
+    std::lock_guard<std::mutex> lk(m_lock);
+    m_complete = true;
+    m_error = err;
+    m_cv.notify_all();
+}
+
+void atg_dtv::Transcoder::wait() {
+    std::unique_lock<std::mutex> lk(m_lock);
+    m_cv.wait(lk, [this] { return m_complete; });
+}
+
+bool atg_dtv::Transcoder::isComplete() {
+    std::lock_guard<std::mutex> lk(m_lock);
+    return m_complete;
+}
+
+atg_dtv::Encoder::Error atg_dtv::Transcoder::getError() {
+    std::lock_guard<std::mutex> lk(m_lock);
+    return m_error;
+}
+
+atg_dtv::Encoder::Error atg_dtv::Transcoder::transcode() {
+    typedef Encoder::Error Error;
+
+    Error err = openInputStream(&m_video, m_source, AVMEDIA_TYPE_VIDEO, true);
+    if (err != Error::None) { return err; }
+
+    if (m_settings.audio) {
+        // A second demuxer lets audio be read ahead independently of video
+        err = openInputStream(&m_audio, m_source, AVMEDIA_TYPE_AUDIO, false);
+        if (err != Error::None) { return err; }
+
+        if (m_audio.streamIndex >= 0) {
+            if (m_audio.codecContext->sample_fmt != AV_SAMPLE_FMT_S16) {
+                return Error::CouldNotDecodeFrame;
+            }
+
+            m_audioChannels = m_audio.codecContext->channels;
+        }
+    }
+
+    const AVPixelFormat inputFormat =
+            (m_settings.inputAlpha)
+                    ? (m_settings.bgr ? AV_PIX_FMT_BGRA : AV_PIX_FMT_RGBA)
+                    : (m_settings.bgr ? AV_PIX_FMT_BGR24 : AV_PIX_FMT_RGB24);
+
+    Encoder encoder;
+    err = encoder.run(m_settings, m_bufferSize).get();
+
+    const int channels = encoder.getAudioChannels();
+    int64_t frames = 0;
+    while (err == Error::None) {
+        bool decoded = false;
+        err = decodeFrame(&m_video, &decoded);
+        if (err != Error::None || !decoded) { break; }
+
+        Frame *frame = encoder.newFrame(true);
+        err = encoder.getError();
+        if (frame == nullptr || err != Error::None) { break; }
+
+        if (frame->m_rgb == nullptr) {
+            err = Error::MissingFrameBuffer;
+            break;
+        }
+
+        const AVFrame *source = m_video.frame;
+        if (m_swsContext == nullptr) {
+            m_swsContext = sws_getContext(
+                    source->width, source->height,
+                    (AVPixelFormat) source->format, m_settings.inputWidth,
+                    m_settings.inputHeight, inputFormat, SWS_BICUBIC, nullptr,
+                    nullptr, nullptr);
+            if (m_swsContext == nullptr) {
+                err = Error::CouldNotCreateConversionContext;
+                break;
+            }
+        }
+
+        uint8_t *const dst[] = {frame->m_rgb};
+        const int dstStride[] = {frame->m_lineWidth};
+        sws_scale(m_swsContext, (const uint8_t *const *) source->data,
+                  source->linesize, 0, source->height, dst, dstStride);
+
+        if (frame->m_audioSamples > 0) {
+            err = readAudio(frame->m_audioSamples);
+            if (err != Error::None) { break; }
+
+            const size_t available =
+                    (m_audioChannels > 0)
+                            ? (m_audioBuffer.size() - m_audioReadOffset) /
+                                      m_audioChannels
+                            : 0;
+            const int16_t *samples = m_audioBuffer.data() + m_audioReadOffset;
+            for (int i = 0; i < frame->m_audioSamples; ++i) {
+                for (int c = 0; c < channels; ++c) {
+                    const int sourceChannel =
+                            (c < m_audioChannels) ? c : m_audioChannels - 1;
+                    frame->m_audio[i * channels + c] =
+                            (size_t(i) < available)
+                                    ? samples[i * m_audioChannels +
+                                              sourceChannel]
+                                    : 0;
+                }
+            }
+
+            const size_t consumed =
+                    (size_t(frame->m_audioSamples) < available)
+                            ? size_t(frame->m_audioSamples)
+                            : available;
+            m_audioReadOffset += consumed * m_audioChannels;
+        }
+
+        encoder.submitFrame();
+
+        if (++frames % m_settings.frameRate == 0) {
+            reportProgress(frames, false, Error::None);
+        }
+    }
+
+    encoder.commit();
+    encoder.stop();
+
+    if (err == Error::None) { err = encoder.getError(); }
+    return err;
+}
+
+atg_dtv::Encoder::Error atg_dtv::Transcoder::readAudio(int samples) {
+    typedef Encoder::Error Error;
+
+    if (m_audio.streamIndex < 0) { return Error::None; }
+
+    if (m_audioReadOffset > 0 &&
+        m_audioReadOffset * 2 > m_audioBuffer.size()) {
+        m_audioBuffer.erase(m_audioBuffer.begin(),
+                            m_audioBuffer.begin() + m_audioReadOffset);
+        m_audioReadOffset = 0;
+    }
+
+    const size_t required = size_t(samples) * m_audioChannels;
+    while (m_audioBuffer.size() - m_audioReadOffset < required) {
+        bool decoded = false;
+        const Error err = decodeFrame(&m_audio, &decoded);
+        if (err != Error::None) { return err; }
+        if (!decoded) { break; }
+
+        const int16_t *data = (const int16_t *) m_audio.frame->data[0];
+        m_audioBuffer.insert(
+                m_audioBuffer.end(), data,
+                data + size_t(m_audio.frame->nb_samples) * m_audioChannels);
+    }
+
+    return Error::None;
+}
+
+void atg_dtv::Transcoder::reportProgress(int64_t frames, bool complete,
+                                         Encoder::Error error) {
+    if (!m_callback) { return; }
+
+    Encoder::TranscodeProgress progress;
+    progress.frames = frames;
+    progress.totalFrames = m_totalFrames;
+    progress.complete = complete;
+    progress.error = error;
+
+    m_callback(progress);
+}
+
+void atg_dtv::Transcoder::destroy() {
+    freeInputStream(&m_video);
+    freeInputStream(&m_audio);
+
+    if (m_swsContext != nullptr) {
+        sws_freeContext(m_swsContext);
+        m_swsContext = nullptr;
+    }
+
+    m_audioBuffer.clear();
+    m_audioReadOffset = 0;
+}
@@ -0,0 +1,145 @@
+#include "../../include/dtv/frame_queue.h"
+#include "../../include/dtv/shared_ring.h"
+
+#include <cstdio>
+#include <string>
+
+// Pushes frames through a shared ring from a producer queue to a consumer
+// queue attached to the same segment, in bursts that fill and drain the ring
+// so its indices wrap around many times
+const int Capacity = 5;
+const int FrameCount = Capacity * 40 + 3;
+const int MaxWidth = 37;
+const int MaxHeight = 11;
+const int LineWidth = 128;
+const int PixelSize = 3;
+const int AudioChannels = 2;
+const int MaxAudioSamples = 4;
+
+// ctest reports this as skipped
+const int Skipped = 77;
+
+int frameWidth(int i) { return 1 + i % MaxWidth; }
+int frameHeight(int i) { return 1 + i % MaxHeight; }
+int audioSamples(int i) { return i % (MaxAudioSamples + 1); }
+
+void fillFrame(atg_dtv::Frame *frame, int i) {
+    for (int y = 0; y < frame->m_height; ++y) {
+        uint8_t *row = frame->m_rgb + size_t(y) * frame->m_lineWidth;
+        for (int x = 0; x < frame->m_width * PixelSize; ++x) {
+            row[x] = uint8_t(i * 7 + y * 3 + x);
+        }
+    }
+
+    for (int s = 0; s < frame->m_audioSamples * AudioChannels; ++s) {
+        frame->m_audio[s] = int16_t(i * 11 - s);
+    }
+
+    frame->m_keyframe = (i % 4) == 0;
+}
+
+bool checkFrame(const atg_dtv::Frame *frame, int i) {
+    if (frame->m_width != frameWidth(i) || frame->m_height != frameHeight(i) ||
+        frame->m_audioSamples != audioSamples(i) ||
+        frame->m_keyframe != ((i % 4) == 0)) {
+        return false;
+    }
+
+    for (int y = 0; y < frame->m_height; ++y) {
+        const uint8_t *row = frame->m_rgb + size_t(y) * frame->m_lineWidth;
+        for (int x = 0; x < frame->m_width * PixelSize; ++x) {
+            if (row[x] != uint8_t(i * 7 + y * 3 + x)) { return false; }
+        }
+    }
+
+    for (int s = 0; s < frame->m_audioSamples * AudioChannels; ++s) {
+        if (frame->m_audio[s] != int16_t(i * 11 - s)) { return false; }
+    }
+
+    return true;
+}
+
+bool run(atg_dtv::FrameQueue *producer, atg_dtv::FrameQueue *consumer) {
+    int pushed = 0, popped = 0;
+    for (int burst = 0; popped < FrameCount; ++burst) {
+        // Alternate between filling the ring and pushing a single frame so the
+        // two ends meet at every slot
+        const int pushLimit = (burst % 2 == 0) ? FrameCount : pushed + 1;
+        while (pushed < FrameCount && pushed < pushLimit) {
+            atg_dtv::Frame *frame = producer->newFrame(
+                    frameWidth(pushed), frameHeight(pushed), LineWidth,
+                    audioSamples(pushed), AudioChannels);
+            if (frame == nullptr) { break; }
+
+            fillFrame(frame, pushed++);
+            producer->submitFrame();
+        }
+
+        if (burst % 2 == 0 && pushed < FrameCount &&
+            pushed - popped != Capacity) {
+            fprintf(stderr, "ring reported full with %d of %d frames\n",
+                    pushed - popped, Capacity);
+            return false;
+        }
+
+        const int popLimit = (burst % 3 == 0) ? pushed : popped + 2;
+        while (popped < pushed && popped < popLimit) {
+            atg_dtv::Frame *frame = consumer->peekFrame();
+            if (frame == nullptr) {
+                fprintf(stderr, "frame %d missing\n", popped);
+                return false;
+            } else if (!checkFrame(frame, popped)) {
+                fprintf(stderr, "frame %d differs\n", popped);
+                return false;
+            }
+
+            consumer->popFrame();
+            ++popped;
+        }
+    }
+
+    if (consumer->peekFrame() != nullptr) {
+        fprintf(stderr, "unexpected frame after the last one\n");
+        return false;
+    }
+
+    return true;
+}
+
+int main() {
+    if (!atg_dtv::SharedRing::isSupported()) { return Skipped; }
+
+    atg_dtv::SharedRing::Layout layout;
+    layout.capacity = Capacity;
+    layout.maxWidth = MaxWidth;
+    layout.maxHeight = MaxHeight;
+    layout.lineWidth = LineWidth;
+    layout.audioCapacity = MaxAudioSamples * AudioChannels;
+
+    const std::string name = atg_dtv::SharedRing::uniqueName();
+    atg_dtv::SharedRing ring, attached;
+    if (!ring.create(name, layout, "")) {
+        fprintf(stderr, "could not create %s\n", name.c_str());
+        return 1;
+    } else if (!attached.attach(name)) {
+        fprintf(stderr, "could not attach to %s\n", name.c_str());
+        ring.close();
+        return 1;
+    }
+
+    atg_dtv::FrameQueue producer, consumer;
+    producer.initializeShared(&ring, true);
+    consumer.initializeShared(&attached, false);
+
+    const bool result = run(&producer, &consumer);
+
+    consumer.destroy();
+    producer.destroy();
+    attached.close();
+    ring.close();
+
+    if (!result) { return 1; }
+
+    printf("shared ring round trips passed\n");
+    return 0;
+}
@@ -0,0 +1,133 @@
+#include "../../include/dtv/spill_file.h"
+
+#include <cstdio>
+#include <cstdlib>
+#include <string>
+
+// Round-trips frames through a spill file, which covers the in-tree LZ4
+// compressor and decompressor on data that compresses well, badly and not
+// at all
+const int PixelSize = 3;
+const int AudioChannels = 2;
+
+enum class Pattern { Random, Zero, Gradient, Repeating, Count };
+
+uint8_t pixelValue(Pattern pattern, int frame, size_t i) {
+    switch (pattern) {
+        case Pattern::Random:
+            return uint8_t(rand());
+        case Pattern::Zero:
+            return 0;
+        case Pattern::Gradient:
+            return uint8_t(i / 13 + frame);
+        case Pattern::Repeating:
+        default:
+            // Long matches with the odd literal breaking them up
+            return uint8_t((i % 97) ^ ((rand() % 8) == 0 ? 1 : 0));
+    }
+}
+
+void fillFrame(atg_dtv::Frame *frame, Pattern pattern, int index) {
+    for (int y = 0; y < frame->m_height; ++y) {
+        uint8_t *row = frame->m_rgb + size_t(y) * frame->m_lineWidth;
+        for (int x = 0; x < frame->m_width * PixelSize; ++x) {
+            row[x] = pixelValue(pattern, index,
+                                size_t(y) * frame->m_width * PixelSize + x);
+        }
+    }
+
+    for (size_t i = 0; i < frame->m_convertedCapacity; ++i) {
+        frame->m_converted[i] = pixelValue(pattern, index, i);
+    }
+
+    for (int i = 0; i < frame->m_audioSamples * AudioChannels; ++i) {
+        frame->m_audio[i] = int16_t(index * 31 + i);
+    }
+
+    frame->m_keyframe = (index % 3) == 0;
+}
+
+bool sameFrame(const atg_dtv::Frame &a, const atg_dtv::Frame &b) {
+    if (a.m_width != b.m_width || a.m_height != b.m_height ||
+        a.m_audioSamples != b.m_audioSamples ||
+        a.m_keyframe != b.m_keyframe) {
+        return false;
+    }
+
+    for (int y = 0; y < a.m_height; ++y) {
+        const uint8_t *rowA = a.m_rgb + size_t(y) * a.m_lineWidth;
+        const uint8_t *rowB = b.m_rgb + size_t(y) * b.m_lineWidth;
+        for (int x = 0; x < a.m_width * PixelSize; ++x) {
+            if (rowA[x] != rowB[x]) { return false; }
+        }
+    }
+
+    for (size_t i = 0; i < a.m_convertedCapacity; ++i) {
+        if (a.m_converted[i] != b.m_converted[i]) { return false; }
+    }
+
+    for (int i = 0; i < a.m_audioSamples * AudioChannels; ++i) {
+        if (a.m_audio[i] != b.m_audio[i]) { return false; }
+    }
+
+    return true;
+}
+
+bool roundTrip(bool compress) {
+    const std::string fname = compress ? "dtv_spill_test_lz4.spill"
+                                       : "dtv_spill_test_raw.spill";
+
+    atg_dtv::SpillFile spill;
+    if (!spill.open(fname, compress, PixelSize)) {
+        fprintf(stderr, "could not open %s\n", fname.c_str());
+        return false;
+    }
+
+    bool result = true;
+    for (int i = 0; result && i < 200; ++i) {
+        // Tiny frames exercise the literal-only tail of a block
+        const int width = (i < 20) ? i + 1 : 16 + rand() % 300;
+        const int height = (i < 20) ? 1 : 1 + rand() % 100;
+        const int lineWidth = (width * PixelSize + 63) / 64 * 64;
+        const size_t convertedSize = (i % 4 == 0) ? size_t(width) * 7 : 0;
+        const int audioSamples = i % 5;
+        const Pattern pattern = Pattern(i % int(Pattern::Count));
+
+        atg_dtv::Frame written, read;
+        written.allocate(width, height, lineWidth, audioSamples, AudioChannels,
+                         convertedSize);
+        read.allocate(width, height, lineWidth, audioSamples, AudioChannels,
+                      convertedSize);
+        fillFrame(&written, pattern, i);
+
+        if (spill.write(written, AudioChannels) == 0) {
+            fprintf(stderr, "write %d failed\n", i);
+            result = false;
+        } else if (spill.read(&read) == 0) {
+            fprintf(stderr, "read %d failed\n", i);
+            result = false;
+        } else if (!sameFrame(written, read)) {
+            fprintf(stderr, "frame %d (pattern %d) differs\n", i, int(pattern));
+            result = false;
+        }
+
+        written.destroy();
+        read.destroy();
+
+        if (i % 50 == 49) { spill.rewind(); }
+    }
+
+    // Also removes the file
+    spill.close();
+
+    return result;
+}
+
+int main() {
+    srand(1);
+
+    if (!roundTrip(true) || !roundTrip(false)) { return 1; }
+
+    printf("spill file round trips passed\n");
+    return 0;
+}